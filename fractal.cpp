@@ -7,53 +7,330 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "glm/glm.hpp"
+#include "sinks.h"
+#include "quantize.h"
+#include "fractal.h"
 
 using namespace glm;
 
-#define AA 9
-#define NUM_ITERATIONS 1024
-#define WIDTH 1024
-#define HEIGHT 1024
+/*
+ * Double-double numbers (an unevaluated sum hi + lo of two doubles) give
+ * about 32 significant digits, enough to place the center of a deep zoom
+ * down to a scale of roughly 1e-30. Only what the reference orbit needs
+ * is implemented; the products rely on std::fma being exact.
+ */
+struct dd {
+	double hi, lo;
+
+	dd(double h = 0.0, double l = 0.0) : hi(h), lo(l) {}
+};
+
+static inline dd quick_two_sum(double a, double b)
+{
+	double s = a + b;
+	return dd(s, b - (s - a));
+}
+
+static inline dd operator+(dd a, dd b)
+{
+	double s = a.hi + b.hi;
+	double v = s - a.hi;
+	double e = (a.hi - (s - v)) + (b.hi - v);
+	return quick_two_sum(s, e + a.lo + b.lo);
+}
+
+static inline dd operator-(dd a)
+{
+	return dd(-a.hi, -a.lo);
+}
+
+static inline dd operator-(dd a, dd b)
+{
+	return a + -b;
+}
+
+static inline dd operator*(dd a, dd b)
+{
+	double p = a.hi * b.hi;
+	double e = std::fma(a.hi, b.hi, -p);
+	return quick_two_sum(p, e + a.hi * b.lo + a.lo * b.hi);
+}
+
+static inline dd operator/(dd a, dd b)
+{
+	double q1 = a.hi / b.hi;
+	dd r = a - b * dd(q1);
+	double q2 = r.hi / b.hi;
+	r = r - b * dd(q2);
+	return quick_two_sum(q1, q2) + dd(r.hi / b.hi);
+}
+
+/* Parses a plain decimal like "-0.74364388703715870475"; false if malformed. */
+bool parse_dd(const char *s, dd &out)
+{
+	bool neg = *s == '-';
+	if (*s == '-' || *s == '+') s++;
+
+	dd v = 0.0, div = 1.0;
+	bool frac = false, digits = false;
+
+	for (; *s; s++) {
+		if (*s == '.' && !frac) {
+			frac = true;
+		} else if (*s >= '0' && *s <= '9') {
+			v = v * dd(10.0) + dd(*s - '0');
+			if (frac) div = div * dd(10.0);
+			digits = true;
+		} else {
+			return false;
+		}
+	}
+
+	out = v / div;
+	if (neg) out = -out;
+	return digits;
+}
+
+/*
+ * Everything that describes a shot. The sample grid of every pixel is
+ * aa x aa, and a sample at (x, y) on the full-resolution sample grid maps
+ * to c = (uv + offset) * scale, with uv in [-1, 1] (x stretched by the
+ * aspect ratio). The defaults reproduce the original image.
+ */
+struct params {
+	int width = 1024, height = 1024;
+	int aa = 9;
+	int iterations = 1024;
+	float threshold = 0.0f;     /* adaptive antialiasing, see below */
+
+	vec2 offset = vec2(-1.5, 1.7);
+	float scale = 0.05f;
+	bool offset_set = false, scale_set = false;  /* by set_param() */
+
+	/*
+	 * In Mandelbrot mode every sample iterates z = z * z + c from z = 0
+	 * instead of z = z * z + julia from z = c.
+	 */
+	vec2 julia = vec2(-0.6, -0.45);
+	bool mandelbrot = false;
+
+	/*
+	 * Deep zoom mode places the view at c = center + uv * scale, with the
+	 * center in double-double, and renders it by perturbation (see the
+	 * deep zoom section below). offset is ignored in this mode.
+	 */
+	bool deep = false;
+	dd center[2] = { dd(-0.75), dd(0.0) };
+
+	/* Histogram-equalized coloring instead of the plain smooth coloring. */
+	bool histogram = false;
+
+	/* Darken escaped samples by their distance to the set, see distance_fade(). */
+	bool distance = false;
+};
+
+/*
+ * The image is split into TILE x TILE pixel tiles; one tile of colors
+ * (32 * 32 * sizeof (vec3) = 12KB) stays comfortably inside L1/L2 while
+ * its 81 samples per pixel are accumulated.
+ */
+#define TILE 32
+
+/*
+ * Adaptive antialiasing first takes a COARSE x COARSE subset of the
+ * AA x AA sample grid of every pixel and only renders the full grid
+ * where that pass shows contrast.
+ */
+#define COARSE 3
 
 float map(float x, float in_min, float in_max, float out_min, float out_max)
 {
 	return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
 }
 
-vec3 render_point(int x, int y)
+vec2 sample_coord(const params &p, int x, int y)
+{
+	vec2 c = vec2(x, y) / vec2(p.width * p.aa, p.height * p.aa) * 2.0f - 1.0f;
+	c.x *= (float)p.width / (float)p.height;
+
+	/* In deep zoom mode samples are deltas from p.center. */
+	if (p.deep) return c * p.scale;
+
+	c += p.offset;
+	c *= p.scale;
+
+	return c;
+}
+
+/*
+ * True if c lies in the Mandelbrot set's main cardioid or its period-2
+ * bulb, where the orbit is known to stay bounded.
+ */
+bool in_main_bulbs(float x, float y)
+{
+	double cx = x, cy = y;
+	double q = (cx - 0.25) * (cx - 0.25) + cy * cy;
+
+	return q * (q + (cx - 0.25)) <= 0.25 * cy * cy
+		|| (cx + 1.0) * (cx + 1.0) + cy * cy <= 0.0625;
+}
+
+/*
+ * Returns the escape count of c and leaves |z|^2 at escape in zz.
+ *
+ * Interior samples are cut short in two ways. In Mandelbrot mode the
+ * main cardioid and period-2 bulb are tested analytically. Otherwise the
+ * orbit is checked for periodicity Brent-style: z is compared against a
+ * saved value that is refreshed at every power of two. The comparison is
+ * exact, and the float iteration is deterministic, so an orbit that
+ * revisits a value would cycle forever and never escape; reporting it as
+ * NUM_ITERATIONS straight away gives exactly the same result.
+ */
+template<int ITERATIONS>
+float iterate_point(const params &p, vec2 c, float &zz)
 {
-	vec2 c = vec2(x, y) / vec2(WIDTH * AA, HEIGHT * AA) * 2.0f - 1.0f;
-	c.x *= (float)WIDTH / (float)HEIGHT;
+	const int iterations = ITERATIONS ? ITERATIONS : p.iterations;
+	vec2 set = p.mandelbrot ? c : p.julia;
+
+	float l = 0.0;
+	vec2 z = p.mandelbrot ? vec2(0.0) : vec2(c);
+
+	if (p.mandelbrot && in_main_bulbs(c.x, c.y)) {
+		zz = 0.0;
+		return iterations;
+	}
+
+	vec2 saved = z;
+	int check = 1;
 
-	// c *= 1.25;
+	for (int n = 0; n < iterations; n++)
+	{
+		z = vec2(z.x * z.x - z.y * z.y, 2.0 * z.x * z.y) + set;
+		if (dot(z, z) > 128.0)
+			break;
+		l += 1.0;
+
+		if (z.x == saved.x && z.y == saved.y) {
+			l = iterations;
+			break;
+		}
 
-	c += vec2(-1.5, 1.7);
-	c *= 0.05;
+		if (n + 1 == check) {
+			saved = z;
+			check *= 2;
+		}
+	}
 
-	// c *= 0.03;
-	// c += vec2(-0.744, 0.186);
+	zz = dot(z, z);
+	return l;
+}
 
-	vec2 set = vec2(-0.6, -0.45);
+/*
+ * iterate_point() that also iterates the derivative of z, dz' = 2 z dz
+ * (+ 1 in Mandelbrot mode, where it is dz/dc; in Julia mode dz/dz0 and
+ * starts at 1), and leaves the distance estimate
+ *
+ *     de = |z| log |z| / (2 |dz|)
+ *
+ * of escaped samples in de: about the distance from c to the set. z and
+ * the count are computed exactly as in iterate_point().
+ */
+template<int ITERATIONS>
+float iterate_point_de(const params &p, vec2 c, float &zz, float &de)
+{
+	const int iterations = ITERATIONS ? ITERATIONS : p.iterations;
+	vec2 set = p.mandelbrot ? c : p.julia;
 
 	float l = 0.0;
-	vec2 z = vec2(c);
+	vec2 z = p.mandelbrot ? vec2(0.0) : vec2(c);
+	vec2 dz = vec2(p.mandelbrot ? 0.0 : 1.0, 0.0);
+	float add = p.mandelbrot ? 1.0f : 0.0f;
+
+	de = 0.0f;
+	if (p.mandelbrot && in_main_bulbs(c.x, c.y)) {
+		zz = 0.0;
+		return iterations;
+	}
 
-	for (int n = 0; n < NUM_ITERATIONS; n++)
+	vec2 saved = z;
+	int check = 1;
+
+	for (int n = 0; n < iterations; n++)
 	{
+		dz = vec2(2.0f * (z.x * dz.x - z.y * dz.y) + add, 2.0f * (z.x * dz.y + z.y * dz.x));
 		z = vec2(z.x * z.x - z.y * z.y, 2.0 * z.x * z.y) + set;
 		if (dot(z, z) > 128.0)
 			break;
 		l += 1.0;
+
+		if (z.x == saved.x && z.y == saved.y) {
+			l = iterations;
+			break;
+		}
+
+		if (n + 1 == check) {
+			saved = z;
+			check *= 2;
+		}
 	}
 
-	if (l == (float)NUM_ITERATIONS) return vec3(0.0);
+	zz = dot(z, z);
+	if (l < iterations) de = 0.25f * std::sqrt(zz) * std::log(zz) / length(dz);
+	return l;
+}
+
+/*
+ * Coloring is a separate stage from iteration. The kernels produce an
+ * escape count and |z|^2 per sample; smooth_count() turns those into a
+ * continuous count, or -1 for samples that never escaped, and a palette
+ * maps that to a color.
+ */
+float smooth_count(const params &p, float l, float zz)
+{
+	if (l == (float)p.iterations) return -1.0f;
+
+	float sl = l - log2(log2(zz)) + 4.0;
+	return sl;
+}
 
-	float sl = l - log2(log2(dot(z, z))) + 4.0;
-	float al = smoothstep(-0.1, 0.0, 0.0);
-	l = mix(l, sl, al);
+/* One trip around the cosine palette is 2 pi / 0.15 iterations. */
+const float palette_period = 2.0f * 3.14159265f / 0.15f;
 
+vec3 cosine_color(float l)
+{
 	vec3 col = vec3(0.0);
 
 	col.r = 0.5f + 0.5f * cos(3.0 + l * 0.15 + -0.98803162409286178998774890729446);
@@ -69,30 +346,3005 @@ vec3 render_point(int x, int y)
 	return col;
 }
 
-int main(int argc, char** argv)
+/*
+ * Distance estimation shading: an escaped sample closer to the set than
+ * a pixel is faded towards the interior black in proportion, as if the
+ * set covered that much of the pixel. Thin filaments that the samples
+ * miss still show up, antialiased, with a few samples per pixel.
+ */
+static inline float distance_fade(const params &p, float de)
 {
-	std::ofstream output;
-	output.open("output11.ppm");
-	output << "P3\n" << WIDTH << " " << HEIGHT << "\n255\n";
+	return std::min(de * p.height / (2.0f * p.scale), 1.0f);
+}
 
-	for (int y = 0; y < HEIGHT; y++) {
-		int x;
-		for (x = 0; x < WIDTH; x++) {
-			vec3 color = vec3(0.0);
-			for (int i = 0; i < AA; i++) {
-				for (int j = 0; j < AA; j++) {
-					color += render_point(x * AA + i, y * AA + j);
-				}
+/* The exact coloring of one sample, without the lookup table. */
+vec3 shade(const params &p, float l, float zz)
+{
+	float mu = smooth_count(p, l, zz);
+	return mu < 0.0f ? vec3(0.0) : cosine_color(mu);
+}
+
+/*
+ * The palette as a lookup table: PALETTE_SIZE entries over one period of
+ * cosine_color(), linearly interpolated, which stays within about 1e-4 of
+ * the exact colors on the 0..255 scale.
+ *
+ * With histogram coloring, counts are first mapped through the cumulative
+ * distribution of the counts in the view (in HISTOGRAM_BINS bins per
+ * iteration), so the palette is spread evenly over the pixels instead of
+ * over iterations. The whole distribution then spans one trip around the
+ * palette.
+ */
+#define PALETTE_SIZE 4096
+#define HISTOGRAM_BINS 4
+#define HISTOGRAM_GRID 256
+
+struct palette {
+	std::vector<vec3> lut;
+	std::vector<float> cdf;     /* empty unless histogram coloring */
+
+	vec3 operator()(float mu) const
+	{
+		if (mu < 0.0f) return vec3(0.0);
+
+		if (!cdf.empty()) {
+			float b = std::min(mu * HISTOGRAM_BINS, (float)cdf.size() - 1.001f);
+			int i = (int)b;
+			mu = mix(cdf[i], cdf[i + 1], b - i) * palette_period;
+		}
+
+		float t = mu * (PALETTE_SIZE / palette_period);
+		int i = (int)t;
+		return mix(lut[i % PALETTE_SIZE], lut[i % PALETTE_SIZE + 1], t - i);
+	}
+};
+
+/*
+ * Builds the palette for p. counts are smooth counts of samples spread
+ * over the view; they are only needed for histogram coloring.
+ */
+palette make_palette(const params &p, const std::vector<float> &counts)
+{
+	palette pal;
+
+	pal.lut.resize(PALETTE_SIZE + 1);
+	for (int i = 0; i <= PALETTE_SIZE; i++)
+		pal.lut[i] = cosine_color(i * (palette_period / PALETTE_SIZE));
+
+	if (!p.histogram) return pal;
+
+	std::vector<double> hist((p.iterations + 8) * HISTOGRAM_BINS + 1);
+	double total = 0.0;
+
+	for (float mu : counts) {
+		if (!(mu >= 0.0f)) continue;
+		hist[std::min((size_t)(mu * HISTOGRAM_BINS), hist.size() - 2) + 1] += 1.0;
+		total += 1.0;
+	}
+
+	pal.cdf.resize(hist.size());
+	double sum = 0.0;
+	for (size_t i = 0; i < hist.size(); i++) {
+		sum += hist[i];
+		pal.cdf[i] = total > 0.0 ? sum / total : (float)i / (hist.size() - 1);
+	}
+
+	return pal;
+}
+
+vec3 render_point(const params &p, int x, int y)
+{
+	float zz;
+	float l = iterate_point<0>(p, sample_coord(p, x, y), zz);
+	return shade(p, l, zz);
+}
+
+/*
+ * Escape-time kernels. Each one iterates n samples (cx[i], cy[i]) and
+ * writes the escape count and the final |z|^2 of every sample, exactly
+ * like iterate_point(). The vector versions run 4/8/16 samples per lane
+ * group and freeze lanes that have escaped or been found periodic, so a
+ * group costs as many iterations as its slowest lane.
+ *
+ * Tolerance: the vector kernels perform the same float operations in
+ * the same order as iterate_point() (2 * x * y is exact in both) and are
+ * built with fp-contract=off, so they match render_point() bit for bit.
+ * If the scalar code itself is built with FMA contraction (-march=native
+ * and -ffp-contract=fast), escape counts near the bailout can differ by
+ * one, which the smooth coloring absorbs to within 1/255 per channel of
+ * the averaged pixel.
+ *
+ * Every kernel is a template over the iteration count. ITERATIONS == 0
+ * reads it from the params at run time; the common counts are also
+ * instantiated with a constant trip count (see fixed_iterations).
+ */
+typedef void (*kernel_fn)(const params &p, const float *cx, const float *cy, float *l, float *zz, int n);
+
+template<int ITERATIONS>
+void iterate_scalar(const params &p, const float *cx, const float *cy, float *l, float *zz, int n)
+{
+	for (int i = 0; i < n; i++)
+		l[i] = iterate_point<ITERATIONS>(p, vec2(cx[i], cy[i]), zz[i]);
+}
+
+#ifdef __x86_64__
+template<int ITERATIONS>
+__attribute__((target("sse2"), optimize("fp-contract=off")))
+void iterate_sse2(const params &p, const float *cx, const float *cy, float *l, float *zz, int n)
+{
+	const int iterations = ITERATIONS ? ITERATIONS : p.iterations;
+	const __m128 bail = _mm_set1_ps(128.0f), one = _mm_set1_ps(1.0f);
+	const __m128 full = _mm_set1_ps(iterations);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i);
+		__m128 sx = _mm_set1_ps(p.julia.x), sy = _mm_set1_ps(p.julia.y);
+		__m128 k = _mm_setzero_ps();
+		__m128 active = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+		if (p.mandelbrot) {
+			sx = x, sy = y;
+			x = y = _mm_setzero_ps();
+
+			int bulbs = 0;
+			for (int j = 0; j < 4; j++)
+				bulbs |= in_main_bulbs(cx[i + j], cy[i + j]) << j;
+
+			__m128 inside = _mm_castsi128_ps(_mm_setr_epi32(-(bulbs & 1), -(bulbs >> 1 & 1),
+				-(bulbs >> 2 & 1), -(bulbs >> 3 & 1)));
+			k = _mm_and_ps(inside, full);
+			active = _mm_andnot_ps(inside, active);
+		}
+
+		__m128 px = x, py = y;
+		int check = 1;
+
+		for (int it = 0; it < iterations && _mm_movemask_ps(active); it++) {
+			__m128 xy = _mm_mul_ps(x, y);
+			__m128 nx = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), sx);
+			__m128 ny = _mm_add_ps(_mm_add_ps(xy, xy), sy);
+			__m128 d = _mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny));
+			__m128 esc = _mm_cmpgt_ps(d, bail);
+
+			x = _mm_or_ps(_mm_and_ps(active, nx), _mm_andnot_ps(active, x));
+			y = _mm_or_ps(_mm_and_ps(active, ny), _mm_andnot_ps(active, y));
+			active = _mm_andnot_ps(esc, active);
+			k = _mm_add_ps(k, _mm_and_ps(active, one));
+
+			__m128 cycle = _mm_and_ps(active, _mm_and_ps(_mm_cmpeq_ps(x, px), _mm_cmpeq_ps(y, py)));
+			k = _mm_or_ps(_mm_and_ps(cycle, full), _mm_andnot_ps(cycle, k));
+			active = _mm_andnot_ps(cycle, active);
+
+			if (it + 1 == check) {
+				px = x, py = y;
+				check *= 2;
+			}
+		}
+
+		_mm_storeu_ps(l + i, k);
+		_mm_storeu_ps(zz + i, _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+	}
+
+	iterate_scalar<ITERATIONS>(p, cx + i, cy + i, l + i, zz + i, n - i);
+}
+
+template<int ITERATIONS>
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+void iterate_avx2(const params &p, const float *cx, const float *cy, float *l, float *zz, int n)
+{
+	const int iterations = ITERATIONS ? ITERATIONS : p.iterations;
+	const __m256 bail = _mm256_set1_ps(128.0f), one = _mm256_set1_ps(1.0f);
+	const __m256 full = _mm256_set1_ps(iterations);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps(cx + i), y = _mm256_loadu_ps(cy + i);
+		__m256 sx = _mm256_set1_ps(p.julia.x), sy = _mm256_set1_ps(p.julia.y);
+		__m256 k = _mm256_setzero_ps();
+		__m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+		if (p.mandelbrot) {
+			sx = x, sy = y;
+			x = y = _mm256_setzero_ps();
+
+			alignas(32) int32_t bulbs[8];
+			for (int j = 0; j < 8; j++)
+				bulbs[j] = -in_main_bulbs(cx[i + j], cy[i + j]);
+
+			__m256 inside = _mm256_castsi256_ps(_mm256_load_si256((const __m256i *)bulbs));
+			k = _mm256_and_ps(inside, full);
+			active = _mm256_andnot_ps(inside, active);
+		}
+
+		__m256 px = x, py = y;
+		int check = 1;
+
+		for (int it = 0; it < iterations && !_mm256_testz_ps(active, active); it++) {
+			__m256 xy = _mm256_mul_ps(x, y);
+			__m256 nx = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), sx);
+			__m256 ny = _mm256_add_ps(_mm256_add_ps(xy, xy), sy);
+			__m256 d = _mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny));
+			__m256 esc = _mm256_cmp_ps(d, bail, _CMP_GT_OQ);
+
+			x = _mm256_blendv_ps(x, nx, active);
+			y = _mm256_blendv_ps(y, ny, active);
+			active = _mm256_andnot_ps(esc, active);
+			k = _mm256_add_ps(k, _mm256_and_ps(active, one));
+
+			__m256 cycle = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(x, px, _CMP_EQ_OQ),
+				_mm256_cmp_ps(y, py, _CMP_EQ_OQ)));
+			k = _mm256_blendv_ps(k, full, cycle);
+			active = _mm256_andnot_ps(cycle, active);
+
+			if (it + 1 == check) {
+				px = x, py = y;
+				check *= 2;
 			}
+		}
+
+		_mm256_storeu_ps(l + i, k);
+		_mm256_storeu_ps(zz + i, _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+	}
+
+	_mm256_zeroupper();
+	iterate_scalar<ITERATIONS>(p, cx + i, cy + i, l + i, zz + i, n - i);
+}
+
+template<int ITERATIONS>
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+void iterate_avx512(const params &p, const float *cx, const float *cy, float *l, float *zz, int n)
+{
+	const int iterations = ITERATIONS ? ITERATIONS : p.iterations;
+	const __m512 bail = _mm512_set1_ps(128.0f), one = _mm512_set1_ps(1.0f);
+	const __m512 full = _mm512_set1_ps(iterations);
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m512 x = _mm512_loadu_ps(cx + i), y = _mm512_loadu_ps(cy + i);
+		__m512 sx = _mm512_set1_ps(p.julia.x), sy = _mm512_set1_ps(p.julia.y);
+		__m512 k = _mm512_setzero_ps();
+		__mmask16 active = 0xFFFF;
+
+		if (p.mandelbrot) {
+			sx = x, sy = y;
+			x = y = _mm512_setzero_ps();
+
+			__mmask16 inside = 0;
+			for (int j = 0; j < 16; j++)
+				inside |= in_main_bulbs(cx[i + j], cy[i + j]) << j;
+
+			k = _mm512_mask_mov_ps(k, inside, full);
+			active &= ~inside;
+		}
 
-			color /= AA * AA;
-			output << (int)color.r << " " << (int)color.g << " " << (int)color.b << "\n";
+		__m512 px = x, py = y;
+		int check = 1;
+
+		for (int it = 0; it < iterations && active; it++) {
+			__m512 xy = _mm512_mul_ps(x, y);
+			__m512 nx = _mm512_add_ps(_mm512_sub_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)), sx);
+			__m512 ny = _mm512_add_ps(_mm512_add_ps(xy, xy), sy);
+			__m512 d = _mm512_add_ps(_mm512_mul_ps(nx, nx), _mm512_mul_ps(ny, ny));
+			__mmask16 esc = _mm512_cmp_ps_mask(d, bail, _CMP_GT_OQ);
+
+			x = _mm512_mask_mov_ps(x, active, nx);
+			y = _mm512_mask_mov_ps(y, active, ny);
+			active &= ~esc;
+			k = _mm512_mask_add_ps(k, active, k, one);
+
+			__mmask16 cycle = _mm512_mask_cmp_ps_mask(active, x, px, _CMP_EQ_OQ)
+				& _mm512_cmp_ps_mask(y, py, _CMP_EQ_OQ);
+			k = _mm512_mask_mov_ps(k, cycle, full);
+			active &= ~cycle;
+
+			if (it + 1 == check) {
+				px = x, py = y;
+				check *= 2;
+			}
 		}
 
-		std::cout << ((double)(y * WIDTH + x) / (double)(WIDTH * HEIGHT))*100.0f << "%" << std::endl;
+		_mm512_storeu_ps(l + i, k);
+		_mm512_storeu_ps(zz + i, _mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)));
 	}
 
-	output.close();
+	_mm256_zeroupper();
+	iterate_scalar<ITERATIONS>(p, cx + i, cy + i, l + i, zz + i, n - i);
+}
+#endif
 
-	return EXIT_SUCCESS;
-}
\ No newline at end of file
+/*
+ * Distance estimation kernels, iterate_point_de() for n samples. The
+ * vector one tracks dz next to z the same way the escape-time kernels
+ * track z, and matches the scalar one in l and zz.
+ */
+typedef void (*de_kernel_fn)(const params &p, const float *cx, const float *cy, float *l, float *zz,
+	float *de, int n);
+
+void iterate_de_scalar(const params &p, const float *cx, const float *cy, float *l, float *zz, float *de, int n)
+{
+	for (int i = 0; i < n; i++)
+		l[i] = iterate_point_de<0>(p, vec2(cx[i], cy[i]), zz[i], de[i]);
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+void iterate_de_avx2(const params &p, const float *cx, const float *cy, float *l, float *zz, float *de, int n)
+{
+	const int iterations = p.iterations;
+	const __m256 bail = _mm256_set1_ps(128.0f), one = _mm256_set1_ps(1.0f);
+	const __m256 full = _mm256_set1_ps(iterations);
+	const __m256 add = _mm256_set1_ps(p.mandelbrot ? 1.0f : 0.0f);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps(cx + i), y = _mm256_loadu_ps(cy + i);
+		__m256 sx = _mm256_set1_ps(p.julia.x), sy = _mm256_set1_ps(p.julia.y);
+		__m256 dx = _mm256_set1_ps(p.mandelbrot ? 0.0f : 1.0f), dy = _mm256_setzero_ps();
+		__m256 k = _mm256_setzero_ps();
+		__m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+		if (p.mandelbrot) {
+			sx = x, sy = y;
+			x = y = _mm256_setzero_ps();
+
+			alignas(32) int32_t bulbs[8];
+			for (int j = 0; j < 8; j++)
+				bulbs[j] = -in_main_bulbs(cx[i + j], cy[i + j]);
+
+			__m256 inside = _mm256_castsi256_ps(_mm256_load_si256((const __m256i *)bulbs));
+			k = _mm256_and_ps(inside, full);
+			active = _mm256_andnot_ps(inside, active);
+		}
+
+		__m256 px = x, py = y;
+		int check = 1;
+
+		for (int it = 0; it < iterations && !_mm256_testz_ps(active, active); it++) {
+			__m256 ndx = _mm256_sub_ps(_mm256_mul_ps(x, dx), _mm256_mul_ps(y, dy));
+			__m256 ndy = _mm256_add_ps(_mm256_mul_ps(x, dy), _mm256_mul_ps(y, dx));
+			ndx = _mm256_add_ps(_mm256_add_ps(ndx, ndx), add);
+			ndy = _mm256_add_ps(ndy, ndy);
+
+			__m256 xy = _mm256_mul_ps(x, y);
+			__m256 nx = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), sx);
+			__m256 ny = _mm256_add_ps(_mm256_add_ps(xy, xy), sy);
+			__m256 d = _mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny));
+			__m256 esc = _mm256_cmp_ps(d, bail, _CMP_GT_OQ);
+
+			x = _mm256_blendv_ps(x, nx, active);
+			y = _mm256_blendv_ps(y, ny, active);
+			dx = _mm256_blendv_ps(dx, ndx, active);
+			dy = _mm256_blendv_ps(dy, ndy, active);
+			active = _mm256_andnot_ps(esc, active);
+			k = _mm256_add_ps(k, _mm256_and_ps(active, one));
+
+			__m256 cycle = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(x, px, _CMP_EQ_OQ),
+				_mm256_cmp_ps(y, py, _CMP_EQ_OQ)));
+			k = _mm256_blendv_ps(k, full, cycle);
+			active = _mm256_andnot_ps(cycle, active);
+
+			if (it + 1 == check) {
+				px = x, py = y;
+				check *= 2;
+			}
+		}
+
+		alignas(32) float dd2[8];
+		_mm256_storeu_ps(l + i, k);
+		_mm256_storeu_ps(zz + i, _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+		_mm256_store_ps(dd2, _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+
+		for (int j = 0; j < 8; j++)
+			de[i + j] = l[i + j] < iterations
+				? 0.25f * std::sqrt(zz[i + j]) * std::log(zz[i + j]) / std::sqrt(dd2[j]) : 0.0f;
+	}
+
+	_mm256_zeroupper();
+	iterate_de_scalar(p, cx + i, cy + i, l + i, zz + i, de + i, n - i);
+}
+#endif
+
+/* Iteration counts that get kernels with a constant trip count. */
+const int fixed_iterations[] = { 256, 512, 1024, 2048, 4096 };
+
+#define SPECIALIZE(k) { k<0>, k<256>, k<512>, k<1024>, k<2048>, k<4096> }
+
+struct kernel {
+	const char *name;
+	bool (*supported)();
+	kernel_fn fn[1 + sizeof fixed_iterations / sizeof *fixed_iterations];
+	de_kernel_fn de;
+
+	kernel_fn specialize(int iterations) const
+	{
+		for (size_t i = 0; i < sizeof fixed_iterations / sizeof *fixed_iterations; i++)
+			if (fixed_iterations[i] == iterations) return fn[i + 1];
+		return fn[0];
+	}
+};
+
+const kernel kernels[] = {
+#ifdef __x86_64__
+	{ "avx512", [] { return (bool)__builtin_cpu_supports("avx512f"); }, SPECIALIZE(iterate_avx512), iterate_de_avx2 },
+	{ "avx2",   [] { return (bool)__builtin_cpu_supports("avx2"); },    SPECIALIZE(iterate_avx2), iterate_de_avx2 },
+	{ "sse2",   [] { return true; },                                     SPECIALIZE(iterate_sse2), iterate_de_scalar },
+#endif
+	{ "scalar", [] { return true; },                                     SPECIALIZE(iterate_scalar), iterate_de_scalar },
+};
+
+/* Picks the named kernel, or the widest one this CPU supports. */
+const kernel *pick_kernel(const char *name)
+{
+	for (const kernel &k : kernels) {
+		if (name ? !strcmp(name, k.name) : k.supported())
+			return k.supported() ? &k : NULL;
+	}
+
+	return NULL;
+}
+
+/*
+ * Deep zoom. Past a scale of about 1e-6 neighbouring samples are no
+ * longer distinct floats, so instead one reference orbit Z is iterated in
+ * double-double at p.center and every sample only tracks its difference
+ * d from it, z = Z + d, in double:
+ *
+ *     d' = 2 * Z * d + d * d (+ dc in Mandelbrot mode)
+ *
+ * where dc is the sample's offset from the center. This loses precision
+ * ("glitches") where z gets close to 0 relative to d, and of course once
+ * the reference itself escapes. In both cases the sample is rebased: its
+ * full z is taken as the new delta against the start of the reference
+ * (d = z - Z[0]) and the reference index starts over.
+ *
+ * The first iterations are skipped with a series approximation,
+ * d_n ~= A_n dc + B_n dc^2 + C_n dc^3, whose coefficients follow the
+ * reference. The skip stops at the first n where the cubic term is no
+ * longer negligible (1e-6 of the linear one) at the corners of the view;
+ * all samples then start at that iteration.
+ */
+typedef std::function<void (const float *cx, const float *cy, float *l, float *zz, float *de, int n)> sampler;
+
+static inline dvec2 cmul(dvec2 a, dvec2 b)
+{
+	return dvec2(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+}
+
+struct reference_orbit {
+	std::vector<dvec2> z;           /* Z[0 .. len], the last one escaped or final */
+	int skip = 0;                   /* iterations covered by the series */
+	dvec2 a, b, c;                  /* series coefficients at skip */
+};
+
+/*
+ * Finds how many iterations the series can skip for the view in p and
+ * stores the coefficients at that point. This only depends on the orbit
+ * and the extent of the view, so a zoom can keep its orbit and just redo
+ * this for every frame.
+ */
+void fit_series(const params &p, reference_orbit &orbit)
+{
+	/* The largest |dc| in the view, at the corners. */
+	double r = p.scale * std::sqrt(1.0 + (double)p.width * p.width / ((double)p.height * p.height));
+	dvec2 a = dvec2(p.mandelbrot ? 0.0 : 1.0, 0.0), b, c;
+
+	orbit.skip = 0;
+	orbit.a = a, orbit.b = b, orbit.c = c;
+
+	/* The escaping iteration itself has to be taken by every sample. */
+	for (int n = 0; n < (int)orbit.z.size() - 2; n++) {
+		dvec2 z2 = dvec2(2.0) * orbit.z[n];
+		dvec2 na = cmul(z2, a) + dvec2(p.mandelbrot ? 1.0 : 0.0, 0.0);
+		dvec2 nb = cmul(z2, b) + cmul(a, a);
+		dvec2 nc = cmul(z2, c) + dvec2(2.0) * cmul(a, b);
+		a = na, b = nb, c = nc;
+
+		if (length(c) * r * r * r > 1e-6 * length(a) * r) break;
+
+		orbit.skip = n + 1;
+		orbit.a = a, orbit.b = b, orbit.c = c;
+	}
+}
+
+reference_orbit compute_reference(const params &p)
+{
+	reference_orbit orbit;
+	dd cx = p.center[0], cy = p.center[1];
+	dd zx = p.mandelbrot ? dd() : cx, zy = p.mandelbrot ? dd() : cy;
+	dd sx = p.mandelbrot ? cx : dd(p.julia.x), sy = p.mandelbrot ? cy : dd(p.julia.y);
+
+	orbit.z.push_back(dvec2(zx.hi, zy.hi));
+
+	for (int n = 0; n < p.iterations; n++) {
+		dd x2 = zx * zx, y2 = zy * zy;
+		zy = dd(2.0) * zx * zy + sy;
+		zx = x2 - y2 + sx;
+		orbit.z.push_back(dvec2(zx.hi, zy.hi));
+
+		if (zx.hi * zx.hi + zy.hi * zy.hi > 128.0) break;
+	}
+
+	fit_series(p, orbit);
+	return orbit;
+}
+
+/* With de, also the distance estimate of iterate_point_de(). */
+void iterate_deep(const params &p, const reference_orbit &orbit,
+	const float *cx, const float *cy, float *l, float *zz, float *de, int n)
+{
+	const std::vector<dvec2> &ref = orbit.z;
+	const int last = ref.size() - 1;
+	const dvec2 add = dvec2(p.mandelbrot ? 1.0 : 0.0);
+
+	for (int i = 0; i < n; i++) {
+		dvec2 dc = dvec2(cx[i], cy[i]);
+		dvec2 dc2 = cmul(dc, dc);
+
+		dvec2 d = cmul(orbit.a, dc) + cmul(orbit.b, dc2) + cmul(orbit.c, cmul(dc2, dc));
+		dvec2 z = ref[orbit.skip] + d;
+		int m = orbit.skip;
+		float k = orbit.skip;
+
+		/* The derivative of the series, then dz' = 2 z dz (+ 1). */
+		dvec2 dz = orbit.a + dvec2(2.0) * cmul(orbit.b, dc) + dvec2(3.0) * cmul(orbit.c, dc2);
+
+		for (int it = orbit.skip; it < p.iterations; it++) {
+			if (de) dz = dvec2(2.0) * cmul(z, dz) + dvec2(add.x, 0.0);
+
+			d = cmul(dvec2(2.0) * ref[m] + d, d) + add * dc;
+			m++;
+
+			z = ref[m] + d;
+			if (dot(z, z) > 128.0) break;
+			k += 1.0;
+
+			dvec2 rebased = z - ref[0];
+			if (m == last || dot(rebased, rebased) < dot(d, d)) {
+				d = rebased;
+				m = 0;
+			}
+		}
+
+		l[i] = k;
+		zz[i] = dot(z, z);
+		if (de) de[i] = k < p.iterations ? 0.25 * std::sqrt(zz[i]) * std::log(zz[i]) / length(dz) : 0.0;
+	}
+}
+
+struct tile {
+	int x, y, w, h;
+};
+
+/*
+ * Where finished pixels go: pixel (x, y) of the image is pixel
+ * (x - left, y - top) of pixels, which has rows of width pixels. That is
+ * the whole image, except when rendering out of core, where only a
+ * window of rows is kept (see render_image()), or a rectangle of it
+ * through the library API.
+ */
+struct canvas {
+	vec3 *pixels;
+	int width, top, left;
+
+	vec3 &at(int x, int y) const { return pixels[(size_t)(y - top) * width + x - left]; }
+};
+
+/*
+ * A small work-stealing pool. Every worker owns a deque of tiles and
+ * pops from the front of its own deque, so bands of the image finish
+ * roughly top to bottom and can be streamed out; when it runs dry it
+ * steals from the back of the others'. All tiles are queued before any
+ * worker starts, so one empty sweep over every deque means the frame is
+ * done.
+ */
+struct tile_queue {
+	std::mutex lock;
+	std::deque<tile> tiles;
+};
+
+bool next_tile(std::vector<tile_queue> &queues, int self, tile &t)
+{
+	int n = queues.size();
+
+	for (int i = 0; i < n; i++) {
+		tile_queue &q = queues[(self + i) % n];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.tiles.empty()) continue;
+
+		if (i == 0) {
+			t = q.tiles.front();
+			q.tiles.pop_front();
+		} else {
+			t = q.tiles.back();
+			q.tiles.pop_back();
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Samples are generated a tile row at a time so the kernel sees long,
+ * coherent runs (t.w * aa * aa samples) instead of one 81-sample pixel.
+ *
+ * Like the kernels, the tile renderers are templates over the sample
+ * grid size so that the common ones get constant trip counts; AA == 0
+ * reads it from the params.
+ */
+typedef long (*tile_fn)(const params &p, const palette &pal, const canvas &image,
+	const tile &t, const sampler &iterate, float *counts);
+
+/*
+ * The buffers of the tile renderers. Every thread keeps its own and
+ * reuses them from tile to tile and from render to render, so the many
+ * small renders of the library API don't allocate per tile.
+ */
+struct tile_scratch {
+	std::vector<float> cx, cy, l, zz, de;           /* the (coarse) samples */
+	std::vector<float> rx, ry, rl, rzz, rde;        /* adaptive: the refining ones */
+	std::vector<vec3> mean;
+	std::vector<float> range;
+	std::vector<int> refine;
+
+	void samples(const params &p, int n)
+	{
+		cx.resize(n), cy.resize(n), l.resize(n), zz.resize(n);
+		de.resize(p.distance ? n : 0);
+	}
+
+	void refining(const params &p, int n)
+	{
+		rx.resize(n), ry.resize(n), rl.resize(n), rzz.resize(n);
+		rde.resize(p.distance ? n : 0);
+	}
+};
+
+static thread_local tile_scratch scratch;
+
+/*
+ * If counts is given, the smooth count of every sample is also stored
+ * there, pixel by pixel in row order and in grid order within a pixel.
+ */
+template<int AA>
+long render_tile(const params &p, const palette &pal, const canvas &image,
+	const tile &t, const sampler &iterate, float *counts)
+{
+	const int aa = AA ? AA : p.aa;
+	int n = t.w * aa * aa;
+	scratch.samples(p, n);
+	std::vector<float> &cx = scratch.cx, &cy = scratch.cy, &l = scratch.l, &zz = scratch.zz, &de = scratch.de;
+
+	for (int y = t.y; y < t.y + t.h; y++) {
+		int k = 0;
+		for (int x = t.x; x < t.x + t.w; x++) {
+			for (int i = 0; i < aa; i++) {
+				for (int j = 0; j < aa; j++, k++) {
+					vec2 c = sample_coord(p, x * aa + i, y * aa + j);
+					cx[k] = c.x;
+					cy[k] = c.y;
+				}
+			}
+		}
+
+		iterate(cx.data(), cy.data(), l.data(), zz.data(), p.distance ? de.data() : NULL, n);
+
+		for (k = 0; k < n; k++)
+			l[k] = smooth_count(p, l[k], zz[k]);
+
+		if (counts)
+			std::copy(l.begin(), l.end(), counts + ((size_t)y * p.width + t.x) * aa * aa);
+
+		k = 0;
+		for (int x = t.x; x < t.x + t.w; x++) {
+			vec3 color = vec3(0.0);
+			for (int s = 0; s < aa * aa; s++, k++)
+				color += p.distance ? pal(l[k]) * distance_fade(p, de[k]) : pal(l[k]);
+
+			color /= aa * aa;
+			image.at(x, y) = color;
+		}
+	}
+
+	return (long)t.w * t.h * aa * aa;
+}
+
+/*
+ * Renders a tile with adaptive antialiasing. The coarse pass covers the
+ * tile plus a one pixel apron so contrast against neighbours can be
+ * measured at tile edges too. A pixel gets the full AA x AA grid if the
+ * coarse samples inside it, or its coarse mean against any of its four
+ * neighbours, differ by more than threshold (on the 0..255 scale) in
+ * any channel; refined pixels are identical to the brute-force render.
+ * threshold is p.threshold. Not every sample is taken, so no counts are
+ * stored.
+ */
+template<int AA>
+long render_tile_adaptive(const params &p, const palette &pal, const canvas &image,
+	const tile &t, const sampler &iterate, float *)
+{
+	const int aa = AA ? AA : p.aa;
+	const float threshold = p.threshold;
+	const int grid = aa < COARSE ? aa : COARSE, step = aa / grid;
+	const int per = grid * grid;
+	int cw = t.w + 2, ch = t.h + 2, n = cw * ch * per;
+	scratch.samples(p, n);
+	std::vector<float> &cx = scratch.cx, &cy = scratch.cy, &l = scratch.l, &zz = scratch.zz, &de = scratch.de;
+	std::vector<vec3> &mean = scratch.mean;
+	std::vector<float> &range = scratch.range;
+	mean.resize(cw * ch);
+	range.resize(cw * ch);
+	long samples = n;
+
+	int k = 0;
+	for (int y = 0; y < ch; y++) {
+		for (int x = 0; x < cw; x++) {
+			for (int i = 0; i < grid; i++) {
+				for (int j = 0; j < grid; j++, k++) {
+					vec2 c = sample_coord(p, (t.x + x - 1) * aa + i * step + step / 2,
+						(t.y + y - 1) * aa + j * step + step / 2);
+					cx[k] = c.x;
+					cy[k] = c.y;
+				}
+			}
+		}
+	}
+
+	iterate(cx.data(), cy.data(), l.data(), zz.data(), p.distance ? de.data() : NULL, n);
+
+	/* The color of sample k of the coarse (l, zz, de) or the refining pass. */
+	auto color_of = [&](const std::vector<float> &l, const std::vector<float> &zz,
+			const std::vector<float> &de, int k) {
+		vec3 c = pal(smooth_count(p, l[k], zz[k]));
+		return p.distance ? c * distance_fade(p, de[k]) : c;
+	};
+
+	k = 0;
+	for (int q = 0; q < cw * ch; q++) {
+		vec3 sum = vec3(0.0), lo = vec3(255.0), hi = vec3(0.0);
+		for (int s = 0; s < per; s++, k++) {
+			vec3 c = color_of(l, zz, de, k);
+			sum += c;
+			for (int q = 0; q < 3; q++) {
+				lo[q] = std::min(lo[q], c[q]);
+				hi[q] = std::max(hi[q], c[q]);
+			}
+		}
+
+		mean[q] = sum / (float)per;
+		range[q] = std::max(hi.r - lo.r, std::max(hi.g - lo.g, hi.b - lo.b));
+	}
+
+	auto contrast = [&](int a, int b) {
+		vec3 d = abs(mean[a] - mean[b]);
+		return std::max(d.r, std::max(d.g, d.b));
+	};
+
+	std::vector<int> &refine = scratch.refine;
+	refine.clear();
+	for (int y = 1; y <= t.h; y++) {
+		for (int x = 1; x <= t.w; x++) {
+			int q = y * cw + x;
+			if (range[q] > threshold
+					|| contrast(q, q - 1) > threshold || contrast(q, q + 1) > threshold
+					|| contrast(q, q - cw) > threshold || contrast(q, q + cw) > threshold)
+				refine.push_back(q);
+			else
+				image.at(t.x + x - 1, t.y + y - 1) = mean[q];
+		}
+	}
+
+	if (refine.empty()) return samples;
+
+	/*
+	 * The coarse samples are points of the full grid, so they are reused
+	 * and only the rest of the grid is iterated; shading still happens
+	 * in grid order so the sum matches the brute-force one exactly.
+	 */
+	auto coarse = [&](int i) { return i % step == step / 2 && i / step < grid; };
+
+	n = refine.size() * (aa * aa - per);
+	scratch.refining(p, n);
+	std::vector<float> &rx = scratch.rx, &ry = scratch.ry, &rl = scratch.rl, &rzz = scratch.rzz, &rde = scratch.rde;
+
+	k = 0;
+	for (int q : refine) {
+		int px = t.x + q % cw - 1, py = t.y + q / cw - 1;
+		for (int i = 0; i < aa; i++) {
+			for (int j = 0; j < aa; j++) {
+				if (coarse(i) && coarse(j)) continue;
+				vec2 c = sample_coord(p, px * aa + i, py * aa + j);
+				rx[k] = c.x;
+				ry[k] = c.y;
+				k++;
+			}
+		}
+	}
+
+	iterate(rx.data(), ry.data(), rl.data(), rzz.data(), p.distance ? rde.data() : NULL, n);
+
+	k = 0;
+	for (int q : refine) {
+		vec3 color = vec3(0.0);
+		for (int i = 0; i < aa; i++) {
+			for (int j = 0; j < aa; j++) {
+				if (coarse(i) && coarse(j)) {
+					color += color_of(l, zz, de, q * per + (i / step) * grid + j / step);
+				} else {
+					color += color_of(rl, rzz, rde, k);
+					k++;
+				}
+			}
+		}
+
+		color /= aa * aa;
+		image.at(t.x + q % cw - 1, t.y + q / cw - 1) = color;
+	}
+
+	return samples + n;
+}
+
+/* The grid sizes that get tile renderers with constant trip counts. */
+tile_fn pick_tile_renderer(const params &p)
+{
+#define TILE_RENDERER(n) (p.threshold > 0.0f ? render_tile_adaptive<n> : render_tile<n>)
+	switch (p.aa) {
+	case 1: return TILE_RENDERER(1);
+	case 2: return TILE_RENDERER(2);
+	case 3: return TILE_RENDERER(3);
+	case 4: return TILE_RENDERER(4);
+	case 8: return TILE_RENDERER(8);
+	case 9: return TILE_RENDERER(9);
+	default: return TILE_RENDERER(0);
+	}
+#undef TILE_RENDERER
+}
+
+/* Peak signal-to-noise ratio of a against b, on the 8-bit output. */
+double psnr(const std::vector<vec3> &a, const std::vector<vec3> &b)
+{
+	double err = 0.0;
+
+	for (size_t i = 0; i < a.size(); i++) {
+		for (int c = 0; c < 3; c++) {
+			double d = (double)to_byte(a[i][c]) - (double)to_byte(b[i][c]);
+			err += d * d;
+		}
+	}
+
+	err /= a.size() * 3;
+	return err == 0.0 ? INFINITY : 10.0 * log10(255.0 * 255.0 / err);
+}
+
+/*
+ * An on-disk cache of finished tiles. A killed render that is started
+ * again with the same cache directory picks up every tile that was done,
+ * and views that overlap share tiles as long as they sit on the same
+ * pixel lattice.
+ *
+ * Tiles are keyed by everything that affects a pixel except the pan:
+ * pixels are numbered on a global lattice (pixel size 2 * scale / height,
+ * anchored at c = 0), the tile grid of the image is aligned to multiples
+ * of TILE on that lattice, and the offset only contributes its sub-pixel
+ * phase to the key. Deep zoom views are keyed by their center instead,
+ * so they only share tiles with themselves, and so are histogram colored
+ * views, whose palette depends on the whole view. Tiles hold the raw colors and
+ * are written to a temporary file and renamed, so a crash never leaves
+ * a half-written tile behind.
+ *
+ * A tile shared with another view is not always bit-identical to a fresh
+ * render: sample_coord() computes c from the offset in float, so the same
+ * lattice point can round differently, and phases within 1e-6 pixel of
+ * each other share a key. The difference is at most a rounding step in c.
+ * Only a run of the same view (a resumed render) is bit for bit the same.
+ */
+static inline long long floor_div(long long a, long long b)
+{
+	return a / b - (a % b < 0);
+}
+
+static inline uint64_t fnv1a(const std::string &s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (char c : s) {
+		h ^= (uint8_t)c;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+class tile_cache {
+	std::string dir;
+	uint64_t key = 0;
+	long long origin_x = 0, origin_y = 0;   /* lattice index of pixel (0, 0) */
+
+	std::string path(const tile &t) const
+	{
+		long long gx = origin_x + t.x, gy = origin_y + t.y;
+		long long tx = floor_div(gx, TILE), ty = floor_div(gy, TILE);
+		char name[128];
+
+		snprintf(name, sizeof name, "/%016llx_%lld_%lld_%lld_%lld_%dx%d.tile",
+			(unsigned long long)key, tx, ty, gx - tx * TILE, gy - ty * TILE, t.w, t.h);
+		return dir + name;
+	}
+
+public:
+	std::atomic<long> hits{0}, misses{0};
+
+	bool open(const char *d, const params &p)
+	{
+		dir = d;
+		mkdir(d, 0755);
+
+		struct stat st;
+		if (stat(d, &st) || !S_ISDIR(st.st_mode)) return false;
+
+		double ox = -p.width / 2.0, oy = -p.height / 2.0;
+		if (!p.deep) {
+			ox = ((double)p.offset.x * p.height - p.width) / 2.0;
+			oy = ((double)p.offset.y - 1.0) * p.height / 2.0;
+		}
+
+		origin_x = (long long)std::floor(ox);
+		origin_y = (long long)std::floor(oy);
+
+		char desc[512];
+		snprintf(desc, sizeof desc, "v2 %d %d %d %a %a %a %a %d %d %lld %lld",
+			p.height, p.aa, p.iterations, p.threshold, p.scale, p.julia.x, p.julia.y,
+			p.mandelbrot, p.deep, std::llround((ox - origin_x) * 1e6), std::llround((oy - origin_y) * 1e6));
+
+		std::string s = desc;
+		if (p.deep) {
+			snprintf(desc, sizeof desc, " %a %a %a %a",
+				p.center[0].hi, p.center[0].lo, p.center[1].hi, p.center[1].lo);
+			s += desc;
+		}
+
+		if (p.histogram) {
+			snprintf(desc, sizeof desc, " histogram %d %a %a", p.width, p.offset.x, p.offset.y);
+			s += desc;
+		}
+
+		if (p.distance) s += " distance";
+
+		key = fnv1a(s);
+
+		return true;
+	}
+
+	/* Where the image's tile grid has to start to line up with the lattice. */
+	int grid_x() const { return (int)(origin_x - floor_div(origin_x, TILE) * TILE); }
+	int grid_y() const { return (int)(origin_y - floor_div(origin_y, TILE) * TILE); }
+
+	bool load(const tile &t, const canvas &image)
+	{
+		FILE *f = fopen(path(t).c_str(), "rb");
+		if (!f) {
+			misses++;
+			return false;
+		}
+
+		std::vector<vec3> pixels(t.w * t.h);
+		bool ok = fread(pixels.data(), sizeof (vec3), pixels.size(), f) == pixels.size()
+			&& fgetc(f) == EOF;
+		fclose(f);
+
+		if (!ok) {
+			misses++;
+			return false;
+		}
+
+		for (int y = 0; y < t.h; y++)
+			std::copy(&pixels[y * t.w], &pixels[y * t.w] + t.w, &image.at(t.x, t.y + y));
+
+		hits++;
+		return true;
+	}
+
+	void store(const tile &t, const canvas &image)
+	{
+		std::string final = path(t), tmp = final + "." + std::to_string(getpid());
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (!f) return;
+
+		bool ok = true;
+		for (int y = 0; y < t.h; y++)
+			ok &= fwrite(&image.at(t.x, t.y + y), sizeof (vec3), t.w, f) == (size_t)t.w;
+
+		if (fclose(f) || !ok || rename(tmp.c_str(), final.c_str()))
+			remove(tmp.c_str());
+	}
+};
+
+/*
+ * Where the time of a render goes, for the benchmark. Kernel and shading
+ * time are summed over all threads; shading is everything a tile costs
+ * besides the kernel (sample coordinates, coloring, the AA sums).
+ * escape_counts is the sum of the samples' escape counts, not of the
+ * iterations executed: an interior sample counts as the full iteration
+ * limit even when the bulb or periodicity checks stopped it early.
+ */
+struct render_stats {
+	std::atomic<long long> kernel_ns{0}, shading_ns{0}, output_ns{0};
+	std::atomic<long long> escape_counts{0};
+};
+
+static inline long long now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct render_options {
+	int nthreads = 1;
+	const kernel *k = NULL;
+	image_sink *sink = NULL;                /* stream bands here as they finish */
+	const reference_orbit *orbit = NULL;    /* deep zoom: use this instead of computing one */
+	const std::vector<tile> *only = NULL;   /* only render tiles that overlap these */
+	tile_cache *cache = NULL;               /* reuse and save finished tiles */
+	render_stats *stats = NULL;             /* add timings here */
+	std::vector<float> *counts = NULL;      /* keep the smooth count of every sample */
+	bool progress = true;                   /* print a line per finished tile */
+	int window = 0;                         /* out of core: rows per chunk, see render_image() */
+};
+
+/* Kernel k, or in deep zoom mode perturbation against orbit. */
+sampler make_sampler(const params &p, const kernel *k, const reference_orbit *orbit)
+{
+	if (p.deep) {
+		return [&p, orbit](const float *cx, const float *cy, float *l, float *zz, float *de, int n) {
+			iterate_deep(p, *orbit, cx, cy, l, zz, de, n);
+		};
+	}
+
+	kernel_fn fn = k->specialize(p.iterations);
+	return [&p, k, fn](const float *cx, const float *cy, float *l, float *zz, float *de, int n) {
+		if (de) k->de(p, cx, cy, l, zz, de, n);
+		else fn(p, cx, cy, l, zz, n);
+	};
+}
+
+/*
+ * Histogram coloring needs the distribution of counts before any pixel
+ * can be colored, so it is estimated from a sparse grid of
+ * HISTOGRAM_GRID x HISTOGRAM_GRID samples over the view first.
+ */
+palette view_palette(const params &p, const sampler &iterate)
+{
+	std::vector<float> spread;
+	if (p.histogram) {
+		std::vector<float> cx, cy;
+		for (int y = 0; y < HISTOGRAM_GRID; y++) {
+			for (int x = 0; x < HISTOGRAM_GRID; x++) {
+				vec2 c = sample_coord(p, (int)((x + 0.5) * p.width * p.aa / HISTOGRAM_GRID),
+					(int)((y + 0.5) * p.height * p.aa / HISTOGRAM_GRID));
+				cx.push_back(c.x);
+				cy.push_back(c.y);
+			}
+		}
+
+		std::vector<float> zz(cx.size());
+		spread.resize(cx.size());
+		iterate(cx.data(), cy.data(), spread.data(), zz.data(), NULL, cx.size());
+		for (size_t i = 0; i < spread.size(); i++)
+			spread[i] = smooth_count(p, spread[i], zz[i]);
+	}
+
+	return make_palette(p, spread);
+}
+
+static inline bool overlaps(const tile &a, const tile &b)
+{
+	return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+/*
+ * Every pixel is computed by exactly the same sequence of operations no
+ * matter which thread renders it, so the result is bit-identical to a
+ * serial render (which is just nthreads == 1).
+ *
+ * p.threshold > 0 turns on adaptive antialiasing. The number of samples
+ * taken is returned.
+ *
+ * If a sink is given, a writer thread streams each band of TILE rows to
+ * it as soon as all of the band's tiles are done, overlapping the output
+ * with the rest of the render. With o.only, tiles outside the given
+ * rectangles keep whatever the image already holds.
+ *
+ * The tile grid normally starts at (0, 0); a tile cache may shift it so
+ * that tiles line up with its lattice. A band is then one row of tiles.
+ *
+ * With o.window the image is rendered out of core, for images that don't
+ * fit in memory: a chunk of bands of about o.window rows at a time, and
+ * image is resized to hold only two chunks. The workers render a chunk
+ * into one half while the writer is still streaming the previous chunk
+ * out of the other, so memory stays at 2 x o.window rows of pixels (12
+ * bytes each) however tall the image is. It needs a sink, and not
+ * o.counts or o.only.
+ */
+long render_image(const params &p, std::vector<vec3> &image, const render_options &o)
+{
+	reference_orbit own;
+	const reference_orbit *orbit = o.orbit;
+	if (p.deep && !orbit) {
+		own = compute_reference(p);
+		orbit = &own;
+
+		if (o.progress)
+			std::cout << "reference orbit: " << own.z.size() - 1 << " iterations, "
+				<< own.skip << " skipped by series approximation" << std::endl;
+	}
+
+	sampler iterate = make_sampler(p, o.k, orbit);
+	palette pal = view_palette(p, iterate);
+
+	float *counts = NULL;
+	if (o.counts) {
+		o.counts->resize((size_t)p.width * p.height * p.aa * p.aa);
+		counts = o.counts->data();
+	}
+
+	tile_fn render = pick_tile_renderer(p);
+	int nthreads = o.nthreads;
+	std::vector<tile_queue> queues(nthreads);
+	int gx = o.cache ? o.cache->grid_x() : 0, gy = o.cache ? o.cache->grid_y() : 0;
+	int bands = (p.height + gy + TILE - 1) / TILE;
+	std::vector<int> left(bands);
+	int total = 0;
+
+	int per = o.window ? std::max(o.window / TILE, 1) : bands;
+	int chunks = (bands + per - 1) / per;
+	if (o.window) image.assign((size_t)2 * per * TILE * p.width, vec3(0.0));
+
+	/* Chunk c is rendered into the half c % 2 of the image. */
+	auto chunk_canvas = [&](int c) {
+		if (!o.window) return canvas{ image.data(), p.width, 0, 0 };
+		return canvas{ &image[(size_t)(c % 2) * per * TILE * p.width], p.width, c * per * TILE - gy, 0 };
+	};
+
+	auto band_tiles = [&](int b, const std::function<void (const tile &)> &f) {
+		int y = b * TILE - gy;
+		for (int x = -gx; x < p.width; x += TILE) {
+			tile t = {
+				std::max(x, 0), std::max(y, 0),
+				std::min(x + TILE, p.width) - std::max(x, 0),
+				std::min(y + TILE, p.height) - std::max(y, 0)
+			};
+
+			if (o.only && std::none_of(o.only->begin(), o.only->end(),
+					[&](const tile &r) { return overlaps(t, r); }))
+				continue;
+
+			f(t);
+		}
+	};
+
+	for (int b = 0; b < bands; b++)
+		band_tiles(b, [&](const tile &) { left[b]++, total++; });
+
+	int done = 0, written = 0;
+	long samples = 0;
+	std::mutex lock;
+	std::condition_variable band_done, chunk_written;
+
+	auto worker = [&](int self, canvas out) {
+		/* Costs two clock reads per kernel call, so only when asked for. */
+		long long kernel_ns = 0;
+		sampler timed = [&](const float *cx, const float *cy, float *l, float *zz, float *de, int n) {
+			long long start = now_ns();
+			iterate(cx, cy, l, zz, de, n);
+			kernel_ns += now_ns() - start;
+
+			double sum = 0.0;
+			for (int i = 0; i < n; i++) sum += l[i];
+			o.stats->escape_counts += (long long)sum;
+		};
+
+		tile t;
+		while (next_tile(queues, self, t)) {
+			long n = 0;
+			if (!o.cache || !o.cache->load(t, out)) {
+				if (o.stats) {
+					long long start = now_ns();
+					kernel_ns = 0;
+					n = render(p, pal, out, t, timed, counts);
+					o.stats->kernel_ns += kernel_ns;
+					o.stats->shading_ns += now_ns() - start - kernel_ns;
+				} else {
+					n = render(p, pal, out, t, iterate, counts);
+				}
+
+				if (o.cache) o.cache->store(t, out);
+			}
+
+			std::lock_guard<std::mutex> guard(lock);
+			samples += n;
+			if (!--left[(t.y + gy) / TILE]) band_done.notify_one();
+			if (o.progress && !o.window)
+				std::cout << (double)++done / (double)total * 100.0 << "%" << std::endl;
+		}
+	};
+
+	auto writer = [&]() {
+		for (int b = 0; b < bands; b++) {
+			std::unique_lock<std::mutex> guard(lock);
+			band_done.wait(guard, [&] { return !left[b]; });
+			guard.unlock();
+
+			int y = std::max(b * TILE - gy, 0);
+			long long start = now_ns();
+			o.sink->write_rows(&chunk_canvas(b / per).at(0, y), std::min((b + 1) * TILE - gy, p.height) - y);
+			if (o.stats) o.stats->output_ns += now_ns() - start;
+
+			if (b % per == per - 1 || b == bands - 1) {
+				guard.lock();
+				written++;
+				chunk_written.notify_one();
+			}
+		}
+	};
+
+	std::thread writing;
+	if (o.sink) writing = std::thread(writer);
+	int queued = 0;
+
+	for (int c = 0; c < chunks; c++) {
+		/* Wait for the writer to be done with the half this chunk goes into. */
+		if (o.window && o.sink && c >= 2) {
+			std::unique_lock<std::mutex> guard(lock);
+			chunk_written.wait(guard, [&] { return written >= c - 1; });
+		}
+
+		for (int b = c * per; b < std::min((c + 1) * per, bands); b++)
+			band_tiles(b, [&](const tile &t) { queues[queued++ % nthreads].tiles.push_back(t); });
+
+		std::vector<std::thread> threads;
+		for (int i = 1; i < nthreads; i++)
+			threads.emplace_back(worker, i, chunk_canvas(c));
+		worker(0, chunk_canvas(c));
+
+		for (auto &th : threads) th.join();
+
+		/* A line per tile would be millions of lines for a poster. */
+		if (o.progress && o.window)
+			std::cout << (double)(c + 1) / (double)chunks * 100.0 << "%" << std::endl;
+	}
+
+	if (writing.joinable()) writing.join();
+	return samples;
+}
+
+/*
+ * Counts files keep the smooth count of every sample of a render, so it
+ * can be colored again (with --recolor) without iterating. They are a
+ * one line text header followed by width * height * aa * aa native
+ * floats in the order render_tile() stores them, which is big: keep aa
+ * low when saving them.
+ */
+bool save_counts(const char *path, const params &p, const std::vector<float> &counts)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) return false;
+
+	fprintf(f, "fractal counts %d %d %d\n", p.width, p.height, p.aa);
+	bool ok = fwrite(counts.data(), sizeof (float), counts.size(), f) == counts.size();
+	return !fclose(f) && ok;
+}
+
+bool load_counts(const char *path, params &p, std::vector<float> &counts)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+
+	int width, height, aa;
+	bool ok = fscanf(f, "fractal counts %d %d %d", &width, &height, &aa) == 3 && fgetc(f) == '\n'
+		&& width > 0 && height > 0 && aa > 0;
+
+	if (ok) {
+		p.width = width, p.height = height, p.aa = aa;
+		counts.resize((size_t)width * height * aa * aa);
+		ok = fread(counts.data(), sizeof (float), counts.size(), f) == counts.size();
+	}
+
+	fclose(f);
+	return ok;
+}
+
+/* Colors saved counts. Histogram coloring gets the exact distribution. */
+void recolor(const params &p, const std::vector<float> &counts, std::vector<vec3> &image)
+{
+	palette pal = make_palette(p, counts);
+	int per = p.aa * p.aa;
+
+	image.resize(p.width * p.height);
+	for (size_t i = 0; i < image.size(); i++) {
+		vec3 color = vec3(0.0);
+		for (int s = 0; s < per; s++)
+			color += pal(counts[i * per + s]);
+
+		image[i] = color / (float)per;
+	}
+}
+
+/*
+ * Progressive rendering: before the real render, quick previews with one
+ * sample per 8x8, 4x4 and then 2x2 block of pixels are written to the
+ * output file, so there is a usable (if blocky) image after a small
+ * fraction of the render time. The last preview is left in image.
+ *
+ * The previews are rendered on their own, and none of their samples are
+ * used by the real render, which costs about (1/64 + 1/16 + 1/4) / aa^2
+ * of it more. And the real render isn't streamed over the last preview
+ * (see main()), so a render that dies leaves the preview rather than
+ * the rows done so far. With --cache the real render takes what tiles it
+ * can from the cache, which after a pan can differ from a fresh render
+ * in the last bit (see tile_cache).
+ */
+bool write_previews(const params &p, const char *format, const char *path,
+	const render_options &o, std::vector<vec3> &image)
+{
+	render_options quiet = o;
+	quiet.sink = NULL;
+	quiet.only = NULL;
+	quiet.cache = NULL;
+	quiet.progress = false;
+
+	for (int block = 8; block >= 2; block /= 2) {
+		params q = p;
+		q.width = std::max(1, p.width / block);
+		q.height = std::max(1, p.height / block);
+		q.aa = 1;
+		q.threshold = 0.0f;
+
+		std::vector<vec3> preview(q.width * q.height);
+		render_image(q, preview, quiet);
+
+		for (int y = 0; y < p.height; y++)
+			for (int x = 0; x < p.width; x++)
+				image[y * p.width + x] = preview[std::min(y / block, q.height - 1) * q.width
+					+ std::min(x / block, q.width - 1)];
+
+		image_sink *sink = new_sink(format);
+		bool ok = sink && sink->open(path, p.width, p.height);
+		if (ok) {
+			sink->write_rows(image.data(), p.height);
+			ok = sink->close();
+		}
+		delete sink;
+
+		if (!ok) return false;
+		std::cout << "wrote a 1/" << block << " resolution preview" << std::endl;
+	}
+
+	return true;
+}
+
+/*
+ * Video sinks take whole frames. Both of them are written to from the
+ * encoder thread of animate(), one frame at a time and in order.
+ */
+class video_sink {
+public:
+	virtual ~video_sink() {}
+	virtual bool open(const char *path, const params &p, int fps) = 0;
+	virtual void add_frame(const std::vector<vec3> &image) = 0;
+	virtual bool close() = 0;
+};
+
+/*
+ * Raw 4:4:4 YUV4MPEG2 with BT.601 studio-range colors, ready to be piped
+ * into an encoder. A path of "-" means stdout.
+ */
+class y4m_sink : public video_sink {
+	FILE *out = NULL;
+	std::vector<uint8_t> planes;
+
+public:
+	bool open(const char *path, const params &p, int fps)
+	{
+		out = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+		if (!out) return false;
+
+		planes.resize(p.width * p.height * 3);
+		fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", p.width, p.height, fps);
+		return true;
+	}
+
+	void add_frame(const std::vector<vec3> &image)
+	{
+		size_t n = image.size();
+		uint8_t *y = planes.data(), *u = y + n, *v = u + n;
+
+		for (size_t i = 0; i < n; i++) {
+			vec3 c = clamp(image[i] / 255.0f, 0.0f, 1.0f);
+			y[i] = 16.5f + 65.481f * c.r + 128.553f * c.g + 24.966f * c.b;
+			u[i] = 128.5f - 37.797f * c.r - 74.203f * c.g + 112.0f * c.b;
+			v[i] = 128.5f + 112.0f * c.r - 93.786f * c.g - 18.214f * c.b;
+		}
+
+		fputs("FRAME\n", out);
+		fwrite(planes.data(), 1, planes.size(), out);
+	}
+
+	bool close()
+	{
+		bool ok = !ferror(out);
+		if (out != stdout) ok = !fclose(out) && ok;
+		else ok = !fflush(out) && ok;
+		return ok;
+	}
+};
+
+/*
+ * GIF's variable-width LZW for one frame's indices, as the code size
+ * byte and the data sub-blocks. Strings are found through a hash of
+ * (prefix code, next index) with linear probing; the table is cleared
+ * when all 4096 codes are taken.
+ */
+void lzw_encode(const uint8_t *pixels, size_t n, int depth, std::vector<uint8_t> &out)
+{
+	const int HASH_SIZE = 8192;
+	const int min_size = depth < 2 ? 2 : depth;
+	const int clear = 1 << min_size, stop = clear + 1;
+
+	std::vector<uint32_t> table(HASH_SIZE);     /* key << 12 | code, or ~0 */
+	int size = min_size + 1, next = stop + 1;
+
+	uint8_t block[256];
+	int used = 0;
+	uint32_t acc = 0;
+	int bits = 0;
+
+	auto put = [&](int code) {
+		acc |= (uint32_t)code << bits;
+		for (bits += size; bits >= 8; bits -= 8, acc >>= 8) {
+			block[1 + used++] = acc & 0xFF;
+			if (used == 255) {
+				block[0] = used;
+				out.insert(out.end(), block, block + 1 + used);
+				used = 0;
+			}
+		}
+	};
+
+	out.push_back(min_size);
+	std::fill(table.begin(), table.end(), ~0u);
+	put(clear);
+
+	int prefix = pixels[0];
+	for (size_t i = 1; i < n; i++) {
+		uint32_t key = prefix << 8 | pixels[i];
+		uint32_t h = (key * 2654435761u) >> 19;
+
+		while (table[h] != ~0u && table[h] >> 12 != key)
+			h = (h + 1) & (HASH_SIZE - 1);
+
+		if (table[h] != ~0u) {
+			prefix = table[h] & 0xFFF;
+			continue;
+		}
+
+		put(prefix);
+		if (next < 4096) {
+			if (next == 1 << size) size++;
+			table[h] = key << 12 | next++;
+		} else {
+			put(clear);
+			std::fill(table.begin(), table.end(), ~0u);
+			size = min_size + 1, next = stop + 1;
+		}
+		prefix = pixels[i];
+	}
+
+	put(prefix);
+	put(stop);
+	if (bits) block[1 + used++] = acc & 0xFF;
+	if (used) {
+		block[0] = used;
+		out.insert(out.end(), block, block + 1 + used);
+	}
+	out.push_back(0);
+}
+
+/*
+ * The GIF palette that follows the coloring: entry 0 is the interior
+ * black and the rest walk once around cosine_color(), which is where
+ * almost every pixel of the render lies.
+ */
+void coloring_palette(uint8_t *rgb)
+{
+	memset(rgb, 0, 3);
+	for (int i = 1; i < 256; i++) {
+		vec3 c = cosine_color((i - 1) * palette_period / 255.0f);
+		rgb[i * 3 + 0] = to_byte(c.r);
+		rgb[i * 3 + 1] = to_byte(c.g);
+		rgb[i * 3 + 2] = to_byte(c.b);
+	}
+}
+
+/* How animations are encoded. */
+struct video_options {
+	int nthreads = 1;
+	bool frame_palette = true;      /* GIF: a palette for each frame */
+	float dither = 0.0f;            /* GIF: ordered dither amplitude, 0..255 */
+};
+
+/*
+ * An animated GIF. Every frame gets a palette made for it (a local
+ * palette), or the whole GIF gets one global palette taken from the
+ * coloring itself, coloring_palette(). That one is quicker but several
+ * times further off, because the lookup table, histogram coloring and
+ * antialiasing all move colors off the palette's curve.
+ *
+ * The frames are encoded so that several can be in flight: every
+ * frame is a job on its own thread that finds the rectangle that changed
+ * since the previous frame (comparing colors, so it doesn't have to wait
+ * for the previous job), maps only that to the palette and LZW-compresses
+ * it. add_frame() writes the finished jobs in order, and waits for the
+ * oldest one when there are as many jobs as threads.
+ */
+class gif_sink : public video_sink {
+	struct job {
+		std::shared_ptr<const std::vector<vec3>> image, prev;
+		std::vector<uint8_t> out;
+		std::thread worker;
+	};
+
+	FILE *out = NULL;
+	int w = 0, h = 0;
+	quantizer colors;
+	video_options options;
+	int delay = 4;
+
+	std::shared_ptr<const std::vector<vec3>> last;
+	std::deque<job *> jobs;
+
+	static void put16(std::vector<uint8_t> &v, int x)
+	{
+		v.push_back(x & 0xFF);
+		v.push_back(x >> 8);
+	}
+
+	void encode(job &j) const
+	{
+		const std::vector<vec3> &image = *j.image;
+		int x0 = 0, y0 = 0, x1 = w, y1 = h;
+
+		if (j.prev) {
+			const std::vector<vec3> &prev = *j.prev;
+			auto same = [&](int i) { return image[i] == prev[i]; };
+			auto row_same = [&](int y) {
+				for (int x = 0; x < w; x++) if (!same(y * w + x)) return false;
+				return true;
+			};
+			auto column_same = [&](int x) {
+				for (int y = y0; y < y1; y++) if (!same(y * w + x)) return false;
+				return true;
+			};
+
+			while (y0 < y1 && row_same(y0)) y0++;
+			while (y1 > y0 && row_same(y1 - 1)) y1--;
+			while (x0 < x1 && column_same(x0)) x0++;
+			while (x1 > x0 && column_same(x1 - 1)) x1--;
+
+			/* Nothing changed: one pixel, just to show the frame for its delay. */
+			if (y0 == y1) x0 = y0 = 0, x1 = y1 = 1;
+		}
+
+		std::vector<vec3> rect;
+		rect.reserve((x1 - x0) * (y1 - y0));
+		for (int y = y0; y < y1; y++)
+			rect.insert(rect.end(), &image[y * w + x0], &image[y * w + x1]);
+
+		quantizer local;
+		const quantizer *q = &colors;
+		if (options.frame_palette) {
+			local.build(rect.data(), rect.size());
+			q = &local;
+		}
+
+		if (options.dither > 0.0f)
+			for (int y = y0, i = 0; y < y1; y++)
+				for (int x = x0; x < x1; x++, i++)
+					rect[i] += dither_offset(x, y) * options.dither;
+
+		if (options.frame_palette) local.prepare(rect.data(), rect.size());
+
+		std::vector<uint8_t> indices(rect.size());
+		q->map(rect.data(), rect.size(), indices.data());
+
+		/* Graphic control: leave the frame in place for the next one. */
+		static const uint8_t control[] = { 0x21, 0xF9, 0x04, 0x04 };
+		j.out.assign(control, control + sizeof control);
+		put16(j.out, delay);
+		j.out.push_back(0);
+		j.out.push_back(0);
+
+		j.out.push_back(0x2C);
+		put16(j.out, x0);
+		put16(j.out, y0);
+		put16(j.out, x1 - x0);
+		put16(j.out, y1 - y0);
+		if (options.frame_palette) {
+			j.out.push_back(0x87);  /* a local palette of 256 entries */
+			j.out.insert(j.out.end(), local.rgb, local.rgb + sizeof local.rgb);
+		} else {
+			j.out.push_back(0);     /* no local palette, not interlaced */
+		}
+
+		lzw_encode(indices.data(), indices.size(), 8, j.out);
+	}
+
+	/* Waits for the oldest job and appends it to the file. */
+	void write_oldest()
+	{
+		job *j = jobs.front();
+		jobs.pop_front();
+		j->worker.join();
+
+		fwrite(j->out.data(), 1, j->out.size(), out);
+		delete j;
+	}
+
+public:
+	gif_sink(const video_options &o) : options(o)
+	{
+		options.nthreads = std::max(1, o.nthreads);
+	}
+
+	bool open(const char *path, const params &p, int fps)
+	{
+		uint8_t palette[256 * 3];
+		coloring_palette(palette);
+
+		if (!options.frame_palette) {
+			colors.set_palette(palette, 256);
+			colors.prepare_all();
+		}
+
+		out = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+		if (!out) return false;
+
+		w = p.width, h = p.height;
+		delay = (100 + fps / 2) / fps;
+
+		/* The screen, with the global palette of 256 entries, and looping forever. */
+		std::vector<uint8_t> header = { 'G', 'I', 'F', '8', '9', 'a' };
+		put16(header, w);
+		put16(header, h);
+		header.insert(header.end(), { 0xF7, 0, 0 });
+		header.insert(header.end(), palette, palette + sizeof palette);
+
+		static const char loop[] = "\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00";
+		header.insert(header.end(), loop, loop + sizeof loop - 1);
+
+		fwrite(header.data(), 1, header.size(), out);
+		return true;
+	}
+
+	void add_frame(const std::vector<vec3> &image)
+	{
+		if ((int)jobs.size() >= options.nthreads) write_oldest();
+
+		job *j = new job;
+		j->image = std::make_shared<const std::vector<vec3>>(image);
+		j->prev = last;
+		last = j->image;
+
+		j->worker = std::thread([this, j] { encode(*j); });
+		jobs.push_back(j);
+	}
+
+	bool close()
+	{
+		while (!jobs.empty()) write_oldest();
+		last.reset();
+
+		fputc(0x3B, out);
+		bool ok = !ferror(out);
+		if (out != stdout) ok = !fclose(out) && ok;
+		else ok = !fflush(out) && ok;
+		return ok;
+	}
+};
+
+video_sink *new_video_sink(const char *format, const video_options &o)
+{
+	if (!strcmp(format, "y4m")) return new y4m_sink;
+	if (!strcmp(format, "gif")) return new gif_sink(o);
+	return NULL;
+}
+
+/*
+ * A zoom/pan path from the view in the params to an end view. The scale
+ * is interpolated exponentially so the zoom speed is constant, and the
+ * center of the view (offset * scale, or p.center in deep zoom mode)
+ * linearly.
+ */
+struct animation {
+	int frames = 0;
+	int fps = 25;
+	float end_scale = 0.0f;         /* 0 means the start scale */
+	bool pan = false;
+	dd end_center[2];
+};
+
+params frame_params(const params &p, const animation &a, int frame)
+{
+	params f = p;
+	double t = a.frames > 1 ? (double)frame / (a.frames - 1) : 0.0;
+	float end = a.end_scale > 0.0f ? a.end_scale : p.scale;
+
+	f.scale = p.scale * std::pow((double)end / p.scale, t);
+
+	if (p.deep) {
+		if (a.pan)
+			for (int i = 0; i < 2; i++)
+				f.center[i] = p.center[i] + (a.end_center[i] - p.center[i]) * dd(t);
+	} else {
+		dvec2 start = dvec2(p.offset) * (double)p.scale;
+		dvec2 stop = a.pan ? dvec2(a.end_center[0].hi, a.end_center[1].hi) : start;
+		dvec2 center = start + (stop - start) * t;
+		f.offset = vec2(center / (double)f.scale);
+	}
+
+	return f;
+}
+
+/*
+ * If the only change between two frames is a pan by a whole number of
+ * pixels, copies what is still visible from the previous frame and
+ * returns the newly exposed strips in exposed. Returns false if nothing
+ * can be reused.
+ */
+bool reuse_pan(const params &prev, const params &cur, const std::vector<vec3> &from,
+	std::vector<vec3> &to, std::vector<tile> &exposed)
+{
+	if (prev.deep || prev.scale != cur.scale) return false;
+
+	/* A pixel is 2 / height units of uv on both axes. */
+	vec2 shift = (cur.offset - prev.offset) * (float)cur.height / 2.0f;
+	int dx = (int)std::lround(shift.x), dy = (int)std::lround(shift.y);
+	int w = cur.width, h = cur.height;
+
+	if (std::fabs(shift.x - dx) > 1e-3f || std::fabs(shift.y - dy) > 1e-3f) return false;
+	if (std::abs(dx) >= w || std::abs(dy) >= h) return false;
+
+	for (int y = 0; y < h; y++) {
+		int sy = y + dy;
+		if (sy < 0 || sy >= h) continue;
+
+		for (int x = 0; x < w; x++) {
+			int sx = x + dx;
+			if (sx >= 0 && sx < w) to[y * w + x] = from[sy * w + sx];
+		}
+	}
+
+	exposed.clear();
+	if (dx > 0) exposed.push_back({ w - dx, 0, dx, h });
+	if (dx < 0) exposed.push_back({ 0, 0, -dx, h });
+	if (dy > 0) exposed.push_back({ 0, h - dy, w, dy });
+	if (dy < 0) exposed.push_back({ 0, 0, w, -dy });
+	return true;
+}
+
+/*
+ * Renders the frames of an animation into a video sink. Frames are
+ * double-buffered: while frame N is being encoded on its own thread,
+ * frame N + 1 is already rendering. A pure zoom in deep mode computes
+ * its reference orbit once and only refits the series approximation for
+ * each frame.
+ */
+bool animate(const params &p, const animation &a, const render_options &base, video_sink *video)
+{
+	std::vector<vec3> buffer[2] = {
+		std::vector<vec3>(p.width * p.height),
+		std::vector<vec3>(p.width * p.height)
+	};
+
+	int rendered = -1, encoded = -1;
+	std::mutex lock;
+	std::condition_variable cv;
+
+	std::thread encoder([&] {
+		for (int i = 0; i < a.frames; i++) {
+			std::unique_lock<std::mutex> guard(lock);
+			cv.wait(guard, [&] { return rendered >= i; });
+			guard.unlock();
+
+			video->add_frame(buffer[i % 2]);
+
+			guard.lock();
+			encoded = i;
+			cv.notify_all();
+		}
+	});
+
+	reference_orbit orbit;
+	if (p.deep && !a.pan) orbit = compute_reference(p);
+
+	params prev;
+	for (int i = 0; i < a.frames; i++) {
+		params f = frame_params(p, a, i);
+		std::vector<vec3> &image = buffer[i % 2];
+		std::vector<tile> exposed;
+		render_options o = base;
+
+		/* This buffer last held frame i - 2, which must be encoded by now. */
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			cv.wait(guard, [&] { return encoded >= i - 2; });
+		}
+
+		if (i > 0 && reuse_pan(prev, f, buffer[(i - 1) % 2], image, exposed))
+			o.only = &exposed;
+
+		if (p.deep && !a.pan) {
+			fit_series(f, orbit);
+			o.orbit = &orbit;
+		}
+
+		render_image(f, image, o);
+		std::cout << "frame " << i + 1 << "/" << a.frames << std::endl;
+		prev = f;
+
+		std::lock_guard<std::mutex> guard(lock);
+		rendered = i;
+		cv.notify_all();
+	}
+
+	encoder.join();
+	return video->close();
+}
+
+/*
+ * Sets one render parameter from its textual value. The same names are
+ * used on the command line (--name value) and in config files
+ * (name = value). Returns false for an unknown name or a bad value.
+ */
+bool set_param(params &p, const char *name, const char *value)
+{
+	if (!strcmp(name, "width"))      return sscanf(value, "%d", &p.width) == 1 && p.width > 0;
+	if (!strcmp(name, "height"))     return sscanf(value, "%d", &p.height) == 1 && p.height > 0;
+	if (!strcmp(name, "aa"))         return sscanf(value, "%d", &p.aa) == 1 && p.aa > 0;
+	if (!strcmp(name, "iterations")) return sscanf(value, "%d", &p.iterations) == 1 && p.iterations > 0;
+	if (!strcmp(name, "adaptive"))   return sscanf(value, "%f", &p.threshold) == 1;
+	if (!strcmp(name, "offset"))     return p.offset_set = sscanf(value, "%f,%f", &p.offset.x, &p.offset.y) == 2;
+	if (!strcmp(name, "scale"))      return p.scale_set = sscanf(value, "%f", &p.scale) == 1;
+	if (!strcmp(name, "julia"))      return sscanf(value, "%f,%f", &p.julia.x, &p.julia.y) == 2;
+
+	if (!strcmp(name, "coloring")) {
+		if (strcmp(value, "smooth") && strcmp(value, "histogram")) return false;
+		p.histogram = !strcmp(value, "histogram");
+		return true;
+	}
+
+	if (!strcmp(name, "deep")) {
+		p.deep = atoi(value);
+		return true;
+	}
+
+	if (!strcmp(name, "distance")) {
+		p.distance = atoi(value);
+		return true;
+	}
+
+	if (!strcmp(name, "center")) {
+		const char *comma = strchr(value, ',');
+		return comma && parse_dd(std::string(value, comma).c_str(), p.center[0])
+			&& parse_dd(comma + 1, p.center[1]);
+	}
+
+	/*
+	 * Switching to Mandelbrot mode also switches to a view of the whole
+	 * set, except for an offset or scale that was set, before or after.
+	 */
+	if (!strcmp(name, "mandelbrot")) {
+		p.mandelbrot = atoi(value);
+		if (p.mandelbrot) {
+			if (!p.offset_set) p.offset = vec2(-0.6, 0.0);
+			if (!p.scale_set) p.scale = 1.25f;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+bool load_config(params &p, const char *path)
+{
+	std::ifstream in(path);
+	if (!in) {
+		std::cerr << "couldn't open " << path << std::endl;
+		return false;
+	}
+
+	std::string line;
+	for (int n = 1; std::getline(in, line); n++) {
+		line = line.substr(0, line.find('#'));
+
+		char name[64], value[256];
+		if (sscanf(line.c_str(), " %63[a-z_] = %255s", name, value) != 2) {
+			if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+			std::cerr << path << ":" << n << ": expected 'name = value'" << std::endl;
+			return false;
+		}
+
+		if (!set_param(p, name, value)) {
+			std::cerr << path << ":" << n << ": bad parameter '" << name << " = " << value << "'" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * The benchmark renders a fixed set of views at every thread count from
+ * 1 up to nthreads (doubling) and prints the fastest of a few runs of
+ * each as JSON, so the numbers can be compared between builds. The image
+ * goes through a real sink to /dev/null so the output stage is measured
+ * too. Kernel and shading seconds are summed over threads; the rates
+ * are per wall-clock second.
+ */
+struct bench_view {
+	const char *name;
+	const char *settings[16];   /* name, value pairs for set_param() */
+};
+
+const bench_view bench_views[] = {
+	{ "interior", { "mandelbrot", "1", "offset", "-0.45,0", "scale", "0.7", NULL } },
+	{ "boundary", { NULL } },   /* the default view */
+	{ "deep", { "width", "128", "height", "128", "mandelbrot", "1", "deep", "1",
+		"iterations", "4096", "scale", "1e-10",
+		"center", "-0.743643887037158704752191506114774,0.131825904205311970493132056385139", NULL } },
+};
+
+#define BENCH_RUNS 3
+
+/*
+ * Maps a rendered view to a palette with the cell lookup and against
+ * every entry (which must agree on every pixel), and prints the time of
+ * each and the RMS error of the mapped image.
+ */
+void bench_quantize(const char *view, const char *name, const quantizer &q, double build_s,
+	const std::vector<vec3> &image, const char *sep)
+{
+	std::vector<uint8_t> fast(image.size()), brute(image.size());
+
+	long long start = now_ns();
+	q.map(image.data(), image.size(), fast.data());
+	double lookup_s = (now_ns() - start) * 1e-9;
+
+	start = now_ns();
+	for (size_t i = 0; i < image.size(); i++)
+		brute[i] = q.brute_nearest(image[i]);
+	double brute_s = (now_ns() - start) * 1e-9;
+
+	long mismatches = 0;
+	double err = 0.0;
+	for (size_t i = 0; i < image.size(); i++) {
+		vec3 d = clamp(image[i], 0.0f, 255.0f) - q.color(fast[i]);
+		mismatches += fast[i] != brute[i];
+		err += dot(d, d);
+	}
+
+	printf("%s\t\t{ \"view\": \"%s\", \"palette\": \"%s\", \"colors\": %d, \"build_s\": %.6f,\n\t\t  "
+		"\"lookup_s\": %.6f, \"brute_s\": %.6f, \"speedup\": %.3f, \"mismatches\": %ld,\n\t\t  "
+		"\"rms_error\": %.3f }",
+		sep, view, name, q.entries, build_s, lookup_s, brute_s, brute_s / lookup_s, mismatches,
+		std::sqrt(err / image.size() / 3));
+}
+
+/*
+ * Prints the time of every bench view at 1 to max_threads threads as JSON.
+ * gcounts_per_s is render_stats::escape_counts per second, which only
+ * equals the iteration rate on views without interior samples.
+ */
+bool bench(const render_options &base, const char *format, int max_threads)
+{
+	std::vector<int> counts;
+	for (int n = 1; n < max_threads; n *= 2) counts.push_back(n);
+	counts.push_back(max_threads);
+
+	printf("{\n\t\"kernel\": \"%s\",\n\t\"compiler\": \"%s\",\n\t\"format\": \"%s\",\n\t\"runs\": [",
+		base.k->name, __VERSION__, format);
+
+	std::vector<std::vector<vec3>> shown;
+
+	const char *sep = "\n";
+	for (const bench_view &v : bench_views) {
+		params p;
+		p.width = p.height = 384;
+		p.aa = 3;
+		for (int i = 0; v.settings[i]; i += 2)
+			set_param(p, v.settings[i], v.settings[i + 1]);
+
+		double single = 0.0;
+		for (int nthreads : counts) {
+			double best = INFINITY;
+			long samples = 0;
+			long long kernel_ns = 0, shading_ns = 0, output_ns = 0, escape_counts = 0;
+
+			for (int run = 0; run < BENCH_RUNS; run++) {
+				std::vector<vec3> image(p.width * p.height);
+				render_stats stats;
+				render_options o = base;
+				o.nthreads = nthreads;
+				o.progress = false;
+				o.stats = &stats;
+
+				image_sink *sink = new_sink(format);
+				if (!sink || !sink->open("/dev/null", p.width, p.height)) {
+					delete sink;
+					return false;
+				}
+				o.sink = sink;
+
+				long long start = now_ns();
+				long n = render_image(p, image, o);
+				sink->close();
+				double seconds = (now_ns() - start) * 1e-9;
+				delete sink;
+
+				if (nthreads == 1 && run == 0) shown.push_back(image);
+
+				if (seconds < best) {
+					best = seconds;
+					samples = n;
+					kernel_ns = stats.kernel_ns;
+					shading_ns = stats.shading_ns;
+					output_ns = stats.output_ns;
+					escape_counts = stats.escape_counts;
+				}
+			}
+
+			if (nthreads == 1) single = best;
+
+			printf("%s\t\t{ \"view\": \"%s\", \"threads\": %d, \"width\": %d, \"height\": %d, "
+				"\"aa\": %d, \"iterations\": %d,\n\t\t  \"seconds\": %.6f, \"samples\": %ld, "
+				"\"msamples_per_s\": %.3f, \"gcounts_per_s\": %.3f,\n\t\t  "
+				"\"kernel_s\": %.6f, \"shading_s\": %.6f, \"output_s\": %.6f, \"speedup\": %.3f }",
+				sep, v.name, nthreads, p.width, p.height, p.aa, p.iterations,
+				best, samples, samples / best * 1e-6, escape_counts / best * 1e-9,
+				kernel_ns * 1e-9, shading_ns * 1e-9, output_ns * 1e-9, single / best);
+			sep = ",\n";
+			fflush(stdout);
+		}
+	}
+
+	printf("\n\t],\n\t\"quantize\": [");
+
+	sep = "\n";
+	for (size_t i = 0; i < shown.size(); i++) {
+		const std::vector<vec3> &image = shown[i];
+		const char *view = bench_views[i].name;
+
+		uint8_t rgb[256 * 3];
+		coloring_palette(rgb);
+		quantizer q;
+		long long start = now_ns();
+		q.set_palette(rgb, 256);
+		q.prepare_all();
+		bench_quantize(view, "coloring", q, (now_ns() - start) * 1e-9, image, sep);
+		sep = ",\n";
+
+		for (int refine : { 0, 2 }) {
+			start = now_ns();
+			q.build(image.data(), image.size(), 256, refine);
+			q.prepare(image.data(), image.size());
+			bench_quantize(view, refine ? "octree+kmeans" : "octree", q, (now_ns() - start) * 1e-9, image, sep);
+		}
+		fflush(stdout);
+	}
+
+	printf("\n\t]\n}\n");
+	return true;
+}
+
+/*
+ * The library API of fractal.h. A view is everything a render_into()
+ * call needs that only depends on the params; it is built by the first
+ * call after a change and shared by the calls that render it. A call
+ * splits its rectangle into tiles and queues them for the context's
+ * threads, then works on queued tiles itself until its own are done.
+ */
+struct context_view {
+	params p;
+	reference_orbit orbit;
+	sampler iterate;
+	palette pal;
+	tile_fn render;
+};
+
+std::shared_ptr<const context_view> make_view(const params &p, const kernel *k)
+{
+	std::shared_ptr<context_view> v = std::make_shared<context_view>();
+	v->p = p;
+	if (p.deep) v->orbit = compute_reference(p);
+	v->iterate = make_sampler(v->p, k, &v->orbit);
+	v->pal = view_palette(v->p, v->iterate);
+	v->render = pick_tile_renderer(v->p);
+	return v;
+}
+
+/* Renders t, at most TILE x TILE, into rgb (where pixel (t.x, t.y) goes). */
+void render_rgb(const context_view &v, const tile &t, uint8_t *rgb, size_t stride)
+{
+	static thread_local std::vector<vec3> pixels(TILE * TILE);
+	v.render(v.p, v.pal, canvas{ pixels.data(), t.w, t.y, t.x }, t, v.iterate, NULL);
+
+	for (int y = 0; y < t.h; y++) {
+		uint8_t *out = rgb + y * stride;
+		for (int x = 0; x < t.w; x++) {
+			const vec3 &c = pixels[y * t.w + x];
+			*out++ = to_byte(c.r);
+			*out++ = to_byte(c.g);
+			*out++ = to_byte(c.b);
+		}
+	}
+}
+
+struct context_job {
+	tile t;
+	std::shared_ptr<const context_view> view;
+	uint8_t *rgb;                           /* where pixel (t.x, t.y) goes */
+	size_t stride;
+	int *left;                              /* tiles of the call still to do */
+};
+
+struct render_context::state {
+	const kernel *k;
+	std::mutex lock, building;
+	std::condition_variable work, finished;
+	std::deque<context_job> jobs;
+	std::vector<std::thread> threads;
+	bool quit = false;
+
+	params p;
+	long changes = 0;
+	std::shared_ptr<const context_view> view;       /* of p, NULL until a call needs it */
+
+	std::shared_ptr<const context_view> current()
+	{
+		std::lock_guard<std::mutex> one(building);
+		params q;
+		long seen;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (view) return view;
+			q = p, seen = changes;
+		}
+
+		std::shared_ptr<const context_view> v = make_view(q, k);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (changes == seen) view = v;
+		return v;
+	}
+
+	/* Runs queued tiles until until() holds; called with lock held. */
+	template<typename F>
+	void serve(std::unique_lock<std::mutex> &guard, std::condition_variable &wait, F until)
+	{
+		while (!until()) {
+			if (jobs.empty()) {
+				wait.wait(guard);
+				continue;
+			}
+
+			context_job j = jobs.front();
+			jobs.pop_front();
+			guard.unlock();
+			render_rgb(*j.view, j.t, j.rgb, j.stride);
+			guard.lock();
+
+			if (!--*j.left) finished.notify_all();
+		}
+	}
+};
+
+render_context::render_context(int nthreads, const char *kernel) : s(new state)
+{
+	s->k = pick_kernel(kernel);
+	if (!s->k) s->k = pick_kernel(NULL);
+	if (nthreads <= 0) nthreads = std::max(1, (int)std::thread::hardware_concurrency());
+
+	state *st = s;
+	for (int i = 1; i < nthreads; i++) {
+		s->threads.emplace_back([st] {
+			std::unique_lock<std::mutex> guard(st->lock);
+			st->serve(guard, st->work, [st] { return st->quit; });
+		});
+	}
+}
+
+render_context::~render_context()
+{
+	{
+		std::lock_guard<std::mutex> guard(s->lock);
+		s->quit = true;
+	}
+	s->work.notify_all();
+
+	for (auto &th : s->threads) th.join();
+	delete s;
+}
+
+bool render_context::set(const char *name, const char *value)
+{
+	std::lock_guard<std::mutex> guard(s->lock);
+	params q = s->p;
+	if (!set_param(q, name, value)) return false;
+
+	s->p = q;
+	s->changes++;
+	s->view = NULL;
+	return true;
+}
+
+int render_context::width() const
+{
+	std::lock_guard<std::mutex> guard(s->lock);
+	return s->p.width;
+}
+
+int render_context::height() const
+{
+	std::lock_guard<std::mutex> guard(s->lock);
+	return s->p.height;
+}
+
+bool render_context::render_into(uint8_t *rgb, size_t stride, const render_rect &r)
+{
+	std::shared_ptr<const context_view> v = s->current();
+	if (r.x < 0 || r.y < 0 || r.w < 0 || r.h < 0 || r.x + r.w > v->p.width || r.y + r.h > v->p.height)
+		return false;
+
+	int left = 0;
+	std::unique_lock<std::mutex> guard(s->lock);
+	for (int y = 0; y < r.h; y += TILE) {
+		for (int x = 0; x < r.w; x += TILE) {
+			tile t = { r.x + x, r.y + y, std::min(TILE, r.w - x), std::min(TILE, r.h - y) };
+			s->jobs.push_back(context_job{ t, v, rgb + y * stride + x * 3, stride, &left });
+			left++;
+		}
+	}
+	s->work.notify_all();
+
+	s->serve(guard, s->finished, [&] { return !left; });
+	return true;
+}
+
+#ifndef FRACTAL_LIBRARY
+/*
+ * Tile server mode (--serve). Tiles are slippy-map style: zoom level z
+ * is the view rendered as a square image of 256 * 2^z pixels, cut into
+ * 2^z x 2^z tiles of 256 x 256, and GET /z/x/y.png returns tile (x, y)
+ * of it as a PNG. Tiles are cut out of that whole image, so they always
+ * line up. Zoom levels stop where the sample grid (256 * 2^z * aa)
+ * outgrows exact float coordinates.
+ *
+ * A tile is looked up in an LRU of encoded tiles in memory, then in the
+ * --cache directory, and only then rendered, by one of nthreads render
+ * threads. A request for a tile that is already being rendered waits for
+ * that render instead of starting another. After every request the
+ * tile's eight neighbours are queued for prefetching, behind requests;
+ * only the latest PREFETCH of those are kept, as the older ones are
+ * where the viewer was. GET /stats returns latency histograms of the
+ * requests by where their tile came from, as JSON.
+ */
+#define SERVER_TILE 256
+#define PREFETCH 64
+
+class tile_server {
+	enum source { MEMORY, DISK, COALESCED, RENDERED, SOURCES };
+
+	static const char *name(source s)
+	{
+		static const char *names[SOURCES] = { "memory", "disk", "coalesced", "rendered" };
+		return names[s];
+	}
+
+	/* Request latencies in buckets of doubling width: bucket b is [2^b, 2^(b+1)) us. */
+	struct histogram {
+		static const int BUCKETS = 26;
+		long count[BUCKETS] = {};
+		long total = 0;
+
+		void add(long long us)
+		{
+			int b = 0;
+			while (b + 1 < BUCKETS && us >= 1LL << (b + 1)) b++;
+			count[b]++;
+			total++;
+		}
+
+		/* The upper end of the bucket the q quantile falls in. */
+		long long quantile(double q) const
+		{
+			long seen = 0;
+			for (int b = 0; b < BUCKETS; b++) {
+				seen += count[b];
+				if (seen > 0 && seen >= q * total) return 1LL << (b + 1);
+			}
+			return 0;
+		}
+	};
+
+	typedef std::shared_ptr<const std::string> png_ptr;
+
+	struct pending {
+		bool done = false;
+		png_ptr png;                    /* NULL if the tile couldn't be made */
+		source from = RENDERED;
+	};
+
+	params base;
+	const kernel *k;
+	std::string dir, prefix;
+	size_t memory_limit;
+	int nthreads, max_zoom;
+
+	std::mutex lock, views_lock;
+	std::condition_variable work, finished;
+	std::vector<std::shared_ptr<const context_view>> views;        /* per zoom, made on first use */
+
+	std::list<uint64_t> order;                      /* most recently used first */
+	std::unordered_map<uint64_t, std::pair<png_ptr, std::list<uint64_t>::iterator>> cached;
+	size_t memory = 0;
+	std::unordered_map<uint64_t, std::shared_ptr<pending>> rendering;
+	std::deque<uint64_t> requested, prefetch;
+	histogram latency[SOURCES];
+	long prefetched = 0;
+
+	static uint64_t key(int z, int x, int y)
+	{
+		return (uint64_t)z << 58 | (uint64_t)x << 29 | (uint64_t)y;
+	}
+
+	static void unkey(uint64_t key, int &z, int &x, int &y)
+	{
+		z = key >> 58, x = (key >> 29) & ((1 << 29) - 1), y = key & ((1 << 29) - 1);
+	}
+
+	bool exists(int z, int x, int y) const
+	{
+		return z >= 0 && z <= max_zoom && x >= 0 && y >= 0 && x < 1 << z && y < 1 << z;
+	}
+
+	std::shared_ptr<const context_view> view(int z)
+	{
+		std::lock_guard<std::mutex> guard(views_lock);
+		if (!views[z]) {
+			params p = base;
+			p.width = p.height = SERVER_TILE << z;
+			views[z] = make_view(p, k);
+		}
+		return views[z];
+	}
+
+	std::string path(uint64_t key) const
+	{
+		int z, x, y;
+		unkey(key, z, x, y);
+		return dir + "/" + prefix + "_" + std::to_string(z) + "_" + std::to_string(x) + "_" + std::to_string(y) + ".png";
+	}
+
+	png_ptr load(uint64_t key)
+	{
+		if (dir.empty()) return NULL;
+
+		std::ifstream in(path(key), std::ios::binary);
+		std::string png((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		if (png.size() < 8 || png.compare(1, 3, "PNG")) return NULL;
+		return std::make_shared<const std::string>(std::move(png));
+	}
+
+	void store(uint64_t key, const std::string &png)
+	{
+		if (dir.empty()) return;
+
+		std::string final = path(key), tmp = final + "." + std::to_string(getpid());
+		std::ofstream out(tmp, std::ios::binary);
+		out.write(png.data(), png.size());
+		out.close();
+
+		if (out.fail() || rename(tmp.c_str(), final.c_str()))
+			remove(tmp.c_str());
+	}
+
+	png_ptr render(uint64_t key)
+	{
+		int z, x, y;
+		unkey(key, z, x, y);
+		std::shared_ptr<const context_view> v = view(z);
+
+		std::vector<vec3> pixels(SERVER_TILE * SERVER_TILE);
+		canvas c = { pixels.data(), SERVER_TILE, y * SERVER_TILE, x * SERVER_TILE };
+		for (int ty = 0; ty < SERVER_TILE; ty += TILE)
+			for (int tx = 0; tx < SERVER_TILE; tx += TILE)
+				v->render(v->p, v->pal, c, tile{ c.left + tx, c.top + ty, TILE, TILE }, v->iterate, NULL);
+
+		png_sink png;
+		png.open(NULL, SERVER_TILE, SERVER_TILE);
+		png.write_rows(pixels.data(), SERVER_TILE);
+		if (!png.close()) return NULL;
+
+		png_ptr encoded = std::make_shared<const std::string>(png.contents());
+		store(key, *encoded);
+		return encoded;
+	}
+
+	/* Called with lock held. */
+	void remember(uint64_t key, const png_ptr &png)
+	{
+		if (cached.count(key)) return;
+
+		order.push_front(key);
+		cached[key] = std::make_pair(png, order.begin());
+		memory += png->size();
+
+		while (memory > memory_limit && order.size() > 1) {
+			auto last = cached.find(order.back());
+			memory -= last->second.first->size();
+			cached.erase(last);
+			order.pop_back();
+		}
+	}
+
+	void render_thread()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;) {
+			work.wait(guard, [&] { return !requested.empty() || !prefetch.empty(); });
+
+			bool asked = !requested.empty();
+			uint64_t k;
+			std::shared_ptr<pending> job;
+			if (asked) {
+				k = requested.front();
+				requested.pop_front();
+				job = rendering[k];
+			} else {
+				k = prefetch.back();
+				prefetch.pop_back();
+				if (cached.count(k) || rendering.count(k)) continue;
+				job = rendering[k] = std::make_shared<pending>();
+			}
+			guard.unlock();
+
+			source from = DISK;
+			png_ptr png = load(k);
+			if (!png) {
+				from = RENDERED;
+				png = render(k);
+			}
+
+			guard.lock();
+			if (png) remember(k, png);
+			if (png && !asked) prefetched++;
+			job->png = png;
+			job->from = from;
+			job->done = true;
+			rendering.erase(k);
+			finished.notify_all();
+		}
+	}
+
+	png_ptr get(int z, int x, int y, source &from)
+	{
+		uint64_t k = key(z, x, y);
+		png_ptr png;
+		std::unique_lock<std::mutex> guard(lock);
+
+		auto c = cached.find(k);
+		if (c != cached.end()) {
+			order.splice(order.begin(), order, c->second.second);
+			png = c->second.first;
+			from = MEMORY;
+		} else {
+			std::shared_ptr<pending> job;
+			auto r = rendering.find(k);
+			if (r != rendering.end()) {
+				job = r->second;
+				from = COALESCED;
+			} else {
+				job = rendering[k] = std::make_shared<pending>();
+				requested.push_back(k);
+				work.notify_all();
+			}
+
+			finished.wait(guard, [&] { return job->done; });
+			png = job->png;
+			if (from != COALESCED) from = job->from;
+		}
+
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dx = -1; dx <= 1; dx++) {
+				uint64_t n = key(z, x + dx, y + dy);
+				if (!exists(z, x + dx, y + dy) || cached.count(n) || rendering.count(n)) continue;
+				prefetch.push_back(n);
+			}
+		}
+
+		while (prefetch.size() > PREFETCH) prefetch.pop_front();
+		work.notify_all();
+		return png;
+	}
+
+	std::string stats()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::string s = "{\n";
+
+		s += "  \"memory_tiles\": " + std::to_string(cached.size()) + ",\n";
+		s += "  \"memory_bytes\": " + std::to_string(memory) + ",\n";
+		s += "  \"rendering\": " + std::to_string(rendering.size()) + ",\n";
+		s += "  \"prefetch_queued\": " + std::to_string(prefetch.size()) + ",\n";
+		s += "  \"prefetched\": " + std::to_string(prefetched) + ",\n";
+		s += "  \"latency_us\": {\n";
+
+		for (int i = 0; i < SOURCES; i++) {
+			const histogram &h = latency[i];
+			s += std::string("    \"") + name((source)i) + "\": { \"count\": " + std::to_string(h.total)
+				+ ", \"p50\": " + std::to_string(h.quantile(0.5))
+				+ ", \"p90\": " + std::to_string(h.quantile(0.9))
+				+ ", \"p99\": " + std::to_string(h.quantile(0.99)) + ", \"buckets\": [";
+
+			int last = histogram::BUCKETS - 1;
+			while (last >= 0 && !h.count[last]) last--;
+			for (int b = 0; b <= last; b++)
+				s += (b ? ", [" : "[") + std::to_string(1LL << (b + 1)) + ", " + std::to_string(h.count[b]) + "]";
+
+			s += i + 1 < SOURCES ? "] },\n" : "] }\n";
+		}
+
+		return s + "  }\n}\n";
+	}
+
+	static void reply(int fd, const char *status, const char *type, const std::string &body,
+		const std::string &headers = "")
+	{
+		std::string head = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + type
+			+ "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n" + headers
+			+ "Connection: close\r\n\r\n";
+		std::string all = head + body;
+
+		for (size_t at = 0; at < all.size(); ) {
+			ssize_t n = send(fd, all.data() + at, all.size() - at, MSG_NOSIGNAL);
+			if (n <= 0) break;
+			at += n;
+		}
+	}
+
+	/* One request per connection. */
+	void handle(int fd)
+	{
+		char req[4096];
+		size_t len = 0;
+		while (len + 1 < sizeof req) {
+			ssize_t n = recv(fd, req + len, sizeof req - 1 - len, 0);
+			if (n <= 0) break;
+			len += n;
+			req[len] = 0;
+			if (strstr(req, "\r\n\r\n")) break;
+		}
+		req[len] = 0;
+
+		long long start = now_ns();
+		int z, x, y, end = 0;
+		if (sscanf(req, "GET /%d/%d/%d.png %n", &z, &x, &y, &end) == 3 && end) {
+			if (!exists(z, x, y)) {
+				reply(fd, "404 Not Found", "text/plain", "no such tile\n");
+			} else {
+				source from;
+				png_ptr png = get(z, x, y, from);
+				if (png) {
+					reply(fd, "200 OK", "image/png", *png, std::string("X-Tile-Source: ") + name(from) + "\r\n");
+
+					std::lock_guard<std::mutex> guard(lock);
+					latency[from].add((now_ns() - start) / 1000);
+				} else {
+					reply(fd, "500 Internal Server Error", "text/plain", "couldn't make the tile\n");
+				}
+			}
+		} else if (!strncmp(req, "GET /stats ", 11)) {
+			reply(fd, "200 OK", "application/json", stats());
+		} else {
+			reply(fd, "404 Not Found", "text/plain", "not found\n");
+		}
+
+		close(fd);
+	}
+
+public:
+	tile_server(const params &p, const kernel *k, const char *cache_dir, size_t memory_limit, int nthreads)
+		: base(p), k(k), dir(cache_dir ? cache_dir : ""), memory_limit(memory_limit), nthreads(nthreads)
+	{
+		max_zoom = 0;
+		while (max_zoom < 20 && ((long long)SERVER_TILE << (max_zoom + 1)) * p.aa <= 1 << 24)
+			max_zoom++;
+		views.resize(max_zoom + 1);
+
+		char desc[512];
+		snprintf(desc, sizeof desc, "tiles v1 %d %d %a %a %a %a %a %a %d %d %d %d %a %a %a %a",
+			p.aa, p.iterations, p.threshold, p.offset.x, p.offset.y, p.scale, p.julia.x, p.julia.y,
+			p.mandelbrot, p.deep, p.histogram, p.distance,
+			p.center[0].hi, p.center[0].lo, p.center[1].hi, p.center[1].lo);
+		snprintf(desc, sizeof desc, "%016llx", (unsigned long long)fnv1a(desc));
+		prefix = desc;
+	}
+
+	/* A port number listens on localhost, anything else is a Unix socket path. */
+	bool run(const char *addr)
+	{
+		if (!dir.empty()) mkdir(dir.c_str(), 0755);
+
+		int fd;
+		if (strspn(addr, "0123456789") == strlen(addr)) {
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+			int on = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+			sockaddr_in sa = {};
+			sa.sin_family = AF_INET;
+			sa.sin_port = htons(atoi(addr));
+			sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if (fd < 0 || bind(fd, (sockaddr *)&sa, sizeof sa)) return false;
+		} else {
+			sockaddr_un sa = {};
+			sa.sun_family = AF_UNIX;
+			if (strlen(addr) >= sizeof sa.sun_path) return false;
+			strcpy(sa.sun_path, addr);
+			unlink(addr);
+
+			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0 || bind(fd, (sockaddr *)&sa, sizeof sa)) return false;
+		}
+
+		if (listen(fd, 64)) return false;
+
+		for (int i = 0; i < nthreads; i++)
+			std::thread(&tile_server::render_thread, this).detach();
+
+		std::cout << "serving zoom levels 0 to " << max_zoom << " on " << addr << std::endl;
+
+		for (;;) {
+			int c = accept(fd, NULL, NULL);
+			if (c < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			std::thread(&tile_server::handle, this, c).detach();
+		}
+	}
+};
+
+void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0 << " [options]\n"
+		"  --threads N              worker threads\n"
+		"  --kernel NAME            avx512, avx2, sse2 or scalar\n"
+		"  --format FORMAT          p3, p6, ppm16, png or tiff; gif or y4m for animations\n"
+		"  -o FILE                  output file\n"
+		"  --psnr                   compare an adaptive render against brute force\n"
+		"  --bench                  time a set of reference views, print JSON\n"
+		"  --progressive            write low resolution previews first; the full\n"
+		"                           image is then only written when it's done\n"
+		"  --out-of-core ROWS       keep only 2 x ROWS rows in memory, for posters\n"
+		"  --serve PORT|PATH        serve z/x/y.png tiles over HTTP on a port or socket\n"
+		"  --tile-memory MB         memory for served tiles (256)\n"
+		"  --cache DIR              keep rendered tiles in DIR and reuse them; tiles\n"
+		"                           from a panned view can differ in the last bit\n"
+		"  --save-counts FILE       also save the smooth count of every sample\n"
+		"  --recolor FILE           color saved counts instead of rendering\n"
+		"  --config FILE            read 'name = value' parameters from FILE\n"
+		"  --width N, --height N    image size\n"
+		"  --aa N                   N x N samples per pixel\n"
+		"  --iterations N           iteration limit\n"
+		"  --adaptive THRESHOLD     adaptive antialiasing\n"
+		"  --offset X,Y, --scale S  view: c = (uv + offset) * scale\n"
+		"  --julia X,Y              Julia set constant\n"
+		"  --mandelbrot             render the Mandelbrot set instead, by default\n"
+		"                           all of it (offset -0.6,0, scale 1.25)\n"
+		"  --coloring MODE          smooth or histogram\n"
+		"  --deep                   deep zoom mode: c = center + uv * scale\n"
+		"  --center X,Y             deep zoom center, to about 32 digits\n"
+		"  --distance               shade the set's edge by distance estimation\n"
+		"  --frames N               render an animation of N frames\n"
+		"  --fps N                  animation frame rate\n"
+		"  --zoom-to S              scale at the last frame\n"
+		"  --pan-to X,Y             center of the view at the last frame\n"
+		"  --gif-palette MODE       frame (a palette per frame) or coloring\n"
+		"  --dither AMOUNT          ordered dither for GIFs, 0..255 (0 is off)\n";
+}
+
+int main(int argc, char** argv)
+{
+	params p;
+	int nthreads = std::thread::hardware_concurrency();
+	const char *kernel_name = NULL;
+	const char *format = NULL;
+	const char *path = NULL;
+	bool report_psnr = false;
+	bool progressive = false;
+	bool benchmark = false;
+	const char *cache_dir = NULL;
+	const char *save_path = NULL, *recolor_path = NULL;
+	int window = 0;
+	const char *serve = NULL;
+	int tile_memory = 256;
+	animation anim;
+	video_options video_o;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			nthreads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--kernel") && i + 1 < argc) {
+			kernel_name = argv[++i];
+		} else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+			format = argv[++i];
+		} else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			path = argv[++i];
+		} else if (!strcmp(argv[i], "--psnr")) {
+			report_psnr = true;
+		} else if (!strcmp(argv[i], "--bench")) {
+			benchmark = true;
+		} else if (!strcmp(argv[i], "--progressive")) {
+			progressive = true;
+		} else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+			cache_dir = argv[++i];
+		} else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+			serve = argv[++i];
+		} else if (!strcmp(argv[i], "--tile-memory") && i + 1 < argc) {
+			tile_memory = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--out-of-core") && i + 1 < argc) {
+			window = std::max(TILE, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--save-counts") && i + 1 < argc) {
+			save_path = argv[++i];
+		} else if (!strcmp(argv[i], "--recolor") && i + 1 < argc) {
+			recolor_path = argv[++i];
+		} else if (!strcmp(argv[i], "--mandelbrot")) {
+			set_param(p, "mandelbrot", "1");
+		} else if (!strcmp(argv[i], "--deep")) {
+			set_param(p, "deep", "1");
+		} else if (!strcmp(argv[i], "--distance")) {
+			set_param(p, "distance", "1");
+		} else if (!strcmp(argv[i], "--config") && i + 1 < argc) {
+			if (!load_config(p, argv[++i])) return EXIT_FAILURE;
+		} else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+			anim.frames = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+			anim.fps = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--zoom-to") && i + 1 < argc) {
+			anim.end_scale = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--gif-palette") && i + 1 < argc) {
+			const char *mode = argv[++i];
+			if (strcmp(mode, "coloring") && strcmp(mode, "frame")) {
+				std::cerr << "unknown GIF palette '" << mode << "'" << std::endl;
+				return EXIT_FAILURE;
+			}
+			video_o.frame_palette = !strcmp(mode, "frame");
+		} else if (!strcmp(argv[i], "--dither") && i + 1 < argc) {
+			video_o.dither = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--pan-to") && i + 1 < argc) {
+			params end;
+			if (!set_param(end, "center", argv[++i])) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+
+			anim.pan = true;
+			anim.end_center[0] = end.center[0];
+			anim.end_center[1] = end.center[1];
+		} else if (!strncmp(argv[i], "--", 2) && i + 1 < argc && set_param(p, argv[i] + 2, argv[i + 1])) {
+			i++;
+		} else {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (report_psnr && p.threshold <= 0.0f) {
+		std::cerr << "--psnr compares an adaptive render against brute force, "
+			"so it needs --adaptive" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (nthreads < 1) nthreads = 1;
+	if (!format) format = anim.frames > 0 ? "gif" : "p6";
+
+	std::string default_path = std::string("output11.") + sink_extension(format);
+	if (!path) path = default_path.c_str();
+
+	/* Keep stdout clean for the video stream. */
+	if (!strcmp(path, "-")) std::cout.rdbuf(std::cerr.rdbuf());
+
+	render_options o;
+	o.nthreads = nthreads;
+	o.k = pick_kernel(kernel_name);
+
+	if (!o.k) {
+		std::cerr << "kernel '" << kernel_name << "' is not available on this machine" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (benchmark) {
+		if (!bench(o, format, nthreads)) {
+			std::cerr << "couldn't write '" << format << "' output" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	std::cout << "using the " << o.k->name << " kernel" << std::endl;
+
+	if (serve) {
+		tile_server server(p, o.k, cache_dir, (size_t)tile_memory << 20, nthreads);
+		server.run(serve);
+		std::cerr << "couldn't serve on " << serve << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (anim.frames > 0) {
+		video_o.nthreads = nthreads;
+		video_sink *video = new_video_sink(format, video_o);
+		if (!video) {
+			std::cerr << "unknown video format '" << format << "'" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		if (!video->open(path, p, anim.fps)) {
+			std::cerr << "couldn't open " << path << " for writing" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		o.progress = false;
+		bool ok = animate(p, anim, o, video);
+		delete video;
+
+		if (!ok) {
+			std::cerr << "couldn't write " << path << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	if (window && (progressive || save_path || recolor_path || report_psnr)) {
+		std::cerr << "--out-of-core never has the whole image, so it doesn't work with "
+			"--progressive, --save-counts, --recolor or --psnr" << std::endl;
+		return EXIT_FAILURE;
+	}
+	o.window = window;
+
+	std::vector<float> counts;
+	if (recolor_path && !load_counts(recolor_path, p, counts)) {
+		std::cerr << "couldn't read counts from " << recolor_path << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (save_path) {
+		if (p.threshold > 0.0f) {
+			std::cerr << "--save-counts needs every sample, it doesn't work with --adaptive" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		if (p.distance) {
+			std::cerr << "counts files don't keep distance estimates, so --save-counts doesn't work with --distance" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		o.counts = &counts;
+	}
+
+	tile_cache cache;
+	if (cache_dir) {
+		if (!cache.open(cache_dir, p)) {
+			std::cerr << "couldn't use " << cache_dir << " as a tile cache" << std::endl;
+			return EXIT_FAILURE;
+		}
+		o.cache = &cache;
+	}
+
+	image_sink *sink = new_sink(format);
+	if (!sink) {
+		std::cerr << "unknown output format '" << format << "'" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<vec3> image(window ? 0 : (size_t)p.width * p.height);
+
+	if (recolor_path) {
+		recolor(p, counts, image);
+
+		bool ok = sink->open(path, p.width, p.height);
+		if (ok) {
+			sink->write_rows(image.data(), p.height);
+			ok = sink->close();
+		}
+		delete sink;
+
+		if (!ok) {
+			std::cerr << "couldn't write " << path << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	/*
+	 * With previews in the output file the final image is written in one
+	 * go at the end, instead of truncating the file and streaming it:
+	 * until the render is done the file holds the last preview, not a
+	 * partly written image.
+	 */
+	if (progressive && !write_previews(p, format, path, o, image)) {
+		std::cerr << "couldn't write " << path << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!progressive && !sink->open(path, p.width, p.height)) {
+		std::cerr << "couldn't open " << path << " for writing" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!progressive) o.sink = sink;
+	long samples = render_image(p, image, o);
+
+	if (progressive) {
+		if (!sink->open(path, p.width, p.height)) {
+			std::cerr << "couldn't open " << path << " for writing" << std::endl;
+			return EXIT_FAILURE;
+		}
+		sink->write_rows(image.data(), p.height);
+	}
+
+	if (save_path && !save_counts(save_path, p, counts)) {
+		std::cerr << "couldn't write counts to " << save_path << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (cache_dir)
+		std::cout << cache.hits << " tiles from the cache, " << cache.misses << " rendered" << std::endl;
+
+	long brute = (long)p.width * p.height * p.aa * p.aa;
+
+	if (samples)
+		std::cout << samples << " samples (" << (double)brute / samples
+			<< "x fewer than brute force)" << std::endl;
+
+	/* To size poster jobs by; Linux reports kilobytes. */
+	struct rusage ru;
+	if (!getrusage(RUSAGE_SELF, &ru))
+		std::cout << "peak RSS: " << ru.ru_maxrss / 1024 << " MB" << std::endl;
+
+	if (report_psnr) {
+		params brute_force = p;
+		brute_force.threshold = 0.0f;
+
+		std::vector<vec3> reference(p.width * p.height);
+		render_options quiet = o;
+		quiet.sink = NULL;
+		quiet.cache = NULL;
+		quiet.progress = false;
+		render_image(brute_force, reference, quiet);
+		std::cout << "PSNR against brute force: " << psnr(image, reference) << " dB" << std::endl;
+	}
+
+	bool ok = sink->close();
+	delete sink;
+
+	if (!ok) {
+		std::cerr << "couldn't write " << path << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,63 @@
+/*
+ * fractal.cpp as a library, for rendering views in-process instead of
+ * running the binary and reading its output back. Build fractal.cpp with
+ * -DFRACTAL_LIBRARY, which leaves out main(), link it in and include
+ * this header.
+ */
+
+#ifndef FRACTAL_H
+#define FRACTAL_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct render_rect {
+	int x, y, w, h;
+};
+
+/*
+ * A view and the threads to render it with. Parameters are set by name,
+ * with the names and values of config files (width, height, aa,
+ * iterations, adaptive, offset, scale, julia, mandelbrot, coloring,
+ * deep, center, distance). width and height are the size of the whole
+ * view, and render_into() renders any rectangle of it. Setting mandelbrot
+ * to 1 also moves the view to the whole set, unless offset or scale was
+ * set too, before or after.
+ *
+ * The worker threads, every thread's sample buffers and the view's
+ * palette (and reference orbit in deep zoom mode) are kept from call to
+ * call. Any number of threads may call render_into() at once, also while
+ * another one calls set(); a call renders the view as it was set when
+ * the call started.
+ */
+class render_context {
+	struct state;
+	state *s;
+
+public:
+	/*
+	 * nthreads 0 is one per core, and the threads calling render_into()
+	 * work along with the nthreads - 1 others. kernel is as for --kernel;
+	 * NULL or one this CPU doesn't have picks the widest it has.
+	 */
+	explicit render_context(int nthreads = 0, const char *kernel = NULL);
+	~render_context();
+
+	render_context(const render_context &) = delete;
+	render_context &operator=(const render_context &) = delete;
+
+	/* False for an unknown name or a bad value. */
+	bool set(const char *name, const char *value);
+
+	int width() const;
+	int height() const;
+
+	/*
+	 * Renders rect of the view into rgb, 8-bit RGB with stride bytes from
+	 * one row to the next. The pixels are those of the same view written
+	 * as a P6 by the binary. False if rect isn't inside the view.
+	 */
+	bool render_into(uint8_t *rgb, size_t stride, const render_rect &rect);
+};
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * Palette quantization for the GIF output: building a palette of at most
+ * 256 colors for an image and mapping colors to it. Colors are glm::vec3
+ * on a 0..255 scale, like in the sinks.
+ */
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "glm/glm.hpp"
+
+/*
+ * The nearest palette entry of a color is found in the cell of a 32^3
+ * grid it falls into. Each cell keeps the entries that can be nearest
+ * to some color in it: with D the distance from the cell's center to the
+ * entry nearest to it and r the cell's half diagonal, no entry further
+ * than D + 2r from the center can be. That is exact, and a handful of
+ * candidates instead of 256. Cells are filled in by prepare() for the
+ * colors about to be mapped, so a palette made for one frame only pays
+ * for the cells that frame uses. The candidates of a cell are stored as
+ * columns padded to 4, and searched 4 at a time.
+ */
+class quantizer {
+	static const int CELL_BITS = 5;
+	static const int CELLS = 1 << (3 * CELL_BITS);
+
+	std::vector<int> first, count;          /* per cell, count -1 if not prepared */
+	std::vector<float> pool_r, pool_g, pool_b;
+	std::vector<int> pool_index;
+
+	float r[256], g[256], b[256];
+
+	static glm::vec3 clamped(const glm::vec3 &c)
+	{
+		return glm::vec3(std::min(std::max(c.r, 0.0f), 255.0f),
+			std::min(std::max(c.g, 0.0f), 255.0f),
+			std::min(std::max(c.b, 0.0f), 255.0f));
+	}
+
+	static int cell(const glm::vec3 &c)
+	{
+		const int shift = 8 - CELL_BITS;
+		return ((int)c.r >> shift) << (2 * CELL_BITS) | ((int)c.g >> shift) << CELL_BITS | (int)c.b >> shift;
+	}
+
+	float distance(const glm::vec3 &c, int i) const
+	{
+		float dr = c.r - r[i], dg = c.g - g[i], db = c.b - b[i];
+		return dr * dr + dg * dg + db * db;
+	}
+
+	void fill_cell(int k)
+	{
+		const float size = 1 << (8 - CELL_BITS);
+		const int mask = (1 << CELL_BITS) - 1;
+		glm::vec3 center = (glm::vec3(k >> (2 * CELL_BITS), (k >> CELL_BITS) & mask, k & mask) + 0.5f) * size;
+		float reach = std::sqrt(3.0f) * size;
+
+		float d[256], nearest = INFINITY;
+		for (int i = 0; i < entries; i++) {
+			d[i] = std::sqrt(distance(center, i));
+			nearest = std::min(nearest, d[i]);
+		}
+
+		first[k] = pool_index.size();
+		for (int i = 0; i < entries; i++) {
+			if (d[i] > nearest + reach) continue;
+			pool_r.push_back(r[i]);
+			pool_g.push_back(g[i]);
+			pool_b.push_back(b[i]);
+			pool_index.push_back(i);
+		}
+
+		while (pool_index.size() % 4) {
+			pool_r.push_back(1e18f);
+			pool_g.push_back(1e18f);
+			pool_b.push_back(1e18f);
+			pool_index.push_back(0);
+		}
+		count[k] = pool_index.size() - first[k];
+	}
+
+	void set_floats()
+	{
+		for (int i = 0; i < entries; i++)
+			r[i] = rgb[i * 3], g[i] = rgb[i * 3 + 1], b[i] = rgb[i * 3 + 2];
+
+		first.assign(CELLS, 0);
+		count.assign(CELLS, -1);
+		pool_r.clear(), pool_g.clear(), pool_b.clear(), pool_index.clear();
+	}
+
+public:
+	uint8_t rgb[256 * 3] = {};      /* the palette, zero padded to 256 entries */
+	int entries = 0;
+
+	void set_palette(const uint8_t *colors, int n)
+	{
+		entries = n;
+		memset(rgb, 0, sizeof rgb);
+		memcpy(rgb, colors, n * 3);
+		set_floats();
+	}
+
+	/*
+	 * An octree palette for the colors: the colors are sorted into an
+	 * octree 6 levels deep, and then, deepest level first and the least
+	 * used nodes of a level first, nodes are merged into their parent
+	 * until there are at most max_colors leaves, whose averages are the
+	 * palette. Then refine rounds of k-means on a sample of the colors
+	 * move every entry to the average of the colors it's nearest to.
+	 */
+	void build(const glm::vec3 *colors, size_t n, int max_colors = 256, int refine = 2)
+	{
+		const int DEPTH = 6;
+
+		struct node {
+			float r = 0, g = 0, b = 0;
+			size_t count = 0;
+			int child[8] = {};
+			int children = 0;
+		};
+
+		std::vector<node> nodes(1);
+		std::vector<int> levels[DEPTH];
+		int leaves = 0;
+
+		levels[0].push_back(0);
+		for (size_t i = 0; i < n; i++) {
+			glm::vec3 c = clamped(colors[i]);
+			int R = c.r, G = c.g, B = c.b;
+			int at = 0;
+
+			nodes[0].count++;
+			for (int level = 0; level < DEPTH; level++) {
+				int bit = 7 - level;
+				int k = ((R >> bit) & 1) << 2 | ((G >> bit) & 1) << 1 | ((B >> bit) & 1);
+
+				if (!nodes[at].child[k]) {
+					int added = nodes.size();
+					nodes.push_back(node());
+					nodes[at].child[k] = added;
+					nodes[at].children++;
+					if (level + 1 < DEPTH) levels[level + 1].push_back(added);
+					else leaves++;
+				}
+
+				at = nodes[at].child[k];
+				nodes[at].count++;
+			}
+
+			nodes[at].r += c.r, nodes[at].g += c.g, nodes[at].b += c.b;
+		}
+
+		for (int level = DEPTH - 1; level >= 0 && leaves > max_colors; level--) {
+			std::vector<int> &l = levels[level];
+			std::sort(l.begin(), l.end(), [&](int a, int b) { return nodes[a].count < nodes[b].count; });
+
+			for (size_t i = 0; i < l.size() && leaves > max_colors; i++) {
+				node &m = nodes[l[i]];
+				for (int k = 0; k < 8; k++) {
+					if (!m.child[k]) continue;
+					const node &c = nodes[m.child[k]];
+					m.r += c.r, m.g += c.g, m.b += c.b;
+					m.child[k] = 0;
+				}
+
+				leaves -= m.children - 1;
+				m.children = 0;
+			}
+		}
+
+		uint8_t palette[256 * 3];
+		int found = 0;
+		std::vector<int> stack(1, 0);
+
+		while (!stack.empty()) {
+			const node &m = nodes[stack.back()];
+			stack.pop_back();
+
+			if (m.children) {
+				for (int k = 0; k < 8; k++)
+					if (m.child[k]) stack.push_back(m.child[k]);
+			} else if (m.count && found < 256) {
+				palette[found * 3 + 0] = std::lround(m.r / m.count);
+				palette[found * 3 + 1] = std::lround(m.g / m.count);
+				palette[found * 3 + 2] = std::lround(m.b / m.count);
+				found++;
+			}
+		}
+
+		if (!found) palette[0] = palette[1] = palette[2] = 0, found = 1;
+		set_palette(palette, found);
+
+		std::vector<glm::vec3> sample;
+		size_t step = std::max<size_t>(1, n / 65536);
+		for (size_t i = 0; i < n; i += step)
+			sample.push_back(colors[i]);
+
+		std::vector<uint8_t> nearest(sample.size());
+		for (int round = 0; round < refine; round++) {
+			prepare(sample.data(), sample.size());
+			map(sample.data(), sample.size(), nearest.data());
+
+			double sum[256][3] = {};
+			size_t used[256] = {};
+			for (size_t i = 0; i < sample.size(); i++) {
+				glm::vec3 c = clamped(sample[i]);
+				int k = nearest[i];
+				sum[k][0] += c.r, sum[k][1] += c.g, sum[k][2] += c.b;
+				used[k]++;
+			}
+
+			for (int k = 0; k < entries; k++)
+				for (int j = 0; j < 3 && used[k]; j++)
+					palette[k * 3 + j] = std::lround(sum[k][j] / used[k]);
+			set_palette(palette, entries);
+		}
+	}
+
+	/* Fills in the cells of these colors, so they can be mapped. */
+	void prepare(const glm::vec3 *colors, size_t n)
+	{
+		for (size_t i = 0; i < n; i++) {
+			int k = cell(clamped(colors[i]));
+			if (count[k] < 0) fill_cell(k);
+		}
+	}
+
+	void prepare_all()
+	{
+		for (int k = 0; k < CELLS; k++)
+			if (count[k] < 0) fill_cell(k);
+	}
+
+	/* The nearest entry (the first one of several as near) to a prepared color. */
+	uint8_t nearest(const glm::vec3 &color) const
+	{
+		glm::vec3 c = clamped(color);
+		int k = cell(c);
+		int at = first[k], end = at + count[k];
+
+#ifdef __x86_64__
+		__m128 qr = _mm_set1_ps(c.r), qg = _mm_set1_ps(c.g), qb = _mm_set1_ps(c.b);
+		__m128 best = _mm_set1_ps(INFINITY);
+		__m128i index = _mm_setzero_si128();
+
+		for (; at < end; at += 4) {
+			__m128 dr = _mm_sub_ps(qr, _mm_loadu_ps(&pool_r[at]));
+			__m128 dg = _mm_sub_ps(qg, _mm_loadu_ps(&pool_g[at]));
+			__m128 db = _mm_sub_ps(qb, _mm_loadu_ps(&pool_b[at]));
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+			__m128i closer = _mm_castps_si128(_mm_cmplt_ps(d, best));
+			__m128i candidates = _mm_loadu_si128((const __m128i *)&pool_index[at]);
+			index = _mm_or_si128(_mm_and_si128(closer, candidates), _mm_andnot_si128(closer, index));
+			best = _mm_min_ps(d, best);
+		}
+
+		float d[4];
+		int i[4];
+		_mm_storeu_ps(d, best);
+		_mm_storeu_si128((__m128i *)i, index);
+
+		int found = i[0];
+		float dist = d[0];
+		for (int j = 1; j < 4; j++)
+			if (d[j] < dist || (d[j] == dist && i[j] < found))
+				dist = d[j], found = i[j];
+		return found;
+#else
+		int found = 0;
+		float dist = INFINITY;
+		for (; at < end; at++) {
+			float dr = c.r - pool_r[at], dg = c.g - pool_g[at], db = c.b - pool_b[at];
+			float e = dr * dr + dg * dg + db * db;
+			if (e < dist) dist = e, found = pool_index[at];
+		}
+		return found;
+#endif
+	}
+
+	/* The same by comparing against every entry, to check nearest() against. */
+	uint8_t brute_nearest(const glm::vec3 &color) const
+	{
+		glm::vec3 c = clamped(color);
+		int found = 0;
+		float dist = INFINITY;
+
+		for (int i = 0; i < entries; i++) {
+			float e = distance(c, i);
+			if (e < dist) dist = e, found = i;
+		}
+
+		return found;
+	}
+
+	void map(const glm::vec3 *colors, size_t n, uint8_t *out) const
+	{
+		for (size_t i = 0; i < n; i++)
+			out[i] = nearest(colors[i]);
+	}
+
+	/* The color an index stands for. */
+	glm::vec3 color(int i) const
+	{
+		return glm::vec3(r[i], g[i], b[i]);
+	}
+};
+
+/*
+ * An 8x8 ordered (Bayer) dither offset for pixel (x, y), between -0.5 and
+ * 0.5; scaled by about the distance between neighbouring palette colors
+ * and added to a color before mapping it.
+ */
+static inline float dither_offset(int x, int y)
+{
+	static const uint8_t bayer[8][8] = {
+		{  0, 32,  8, 40,  2, 34, 10, 42 },
+		{ 48, 16, 56, 24, 50, 18, 58, 26 },
+		{ 12, 44,  4, 36, 14, 46,  6, 38 },
+		{ 60, 28, 52, 20, 62, 30, 54, 22 },
+		{  3, 35, 11, 43,  1, 33,  9, 41 },
+		{ 51, 19, 59, 27, 49, 17, 57, 25 },
+		{ 15, 47,  7, 39, 13, 45,  5, 37 },
+		{ 63, 31, 55, 23, 61, 29, 53, 21 },
+	};
+
+	return (bayer[y & 7][x & 7] + 0.5f) / 64.0f - 0.5f;
+}
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * Just enough GLSL to run the ShaderToy programs in this directory on the
+ * CPU. The vector types are templates over their scalar, which is either
+ * float (one pixel) or lanes (LANES pixels at once, in SIMD registers),
+ * so every shader is written once and instantiated for both.
+ *
+ * Arithmetic on lanes maps straight to vector instructions through the
+ * GCC vector extensions; the transcendental functions go lane by lane
+ * through the same libm calls as the float version, so both give the
+ * same result for every pixel. Comparisons on lanes give a mask instead
+ * of a bool, and branches that depend on the pixel have to be written
+ * with select().
+ */
+
+#ifndef GLSL_H
+#define GLSL_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace glsl {
+
+#define LANES 8
+
+typedef float lane_floats __attribute__((vector_size(LANES * sizeof (float))));
+typedef int32_t lane_ints __attribute__((vector_size(LANES * sizeof (int32_t))));
+
+struct mask {
+	lane_ints m;
+
+	friend mask operator&&(mask a, mask b) { return { a.m & b.m }; }
+	friend mask operator||(mask a, mask b) { return { a.m | b.m }; }
+	friend mask operator!(mask a) { return { ~a.m }; }
+};
+
+struct lanes {
+	lane_floats v;
+
+	lanes() : v() {}
+	lanes(double x) : v(lane_floats{} + (float)x) {}
+	lanes(lane_floats x) : v(x) {}
+
+	float operator[](int i) const { return v[i]; }
+
+	friend lanes operator+(lanes a, lanes b) { return a.v + b.v; }
+	friend lanes operator-(lanes a, lanes b) { return a.v - b.v; }
+	friend lanes operator*(lanes a, lanes b) { return a.v * b.v; }
+	friend lanes operator/(lanes a, lanes b) { return a.v / b.v; }
+	friend lanes operator-(lanes a) { return -a.v; }
+
+	lanes &operator+=(lanes b) { v += b.v; return *this; }
+	lanes &operator-=(lanes b) { v -= b.v; return *this; }
+	lanes &operator*=(lanes b) { v *= b.v; return *this; }
+	lanes &operator/=(lanes b) { v /= b.v; return *this; }
+
+	friend mask operator<(lanes a, lanes b)  { return { a.v < b.v }; }
+	friend mask operator>(lanes a, lanes b)  { return { a.v > b.v }; }
+	friend mask operator<=(lanes a, lanes b) { return { a.v <= b.v }; }
+	friend mask operator>=(lanes a, lanes b) { return { a.v >= b.v }; }
+};
+
+inline float select(bool m, float a, float b) { return m ? a : b; }
+inline lanes select(mask m, lanes a, lanes b) { return lane_floats(m.m ? a.v : b.v); }
+inline bool any(bool m) { return m; }
+inline bool all(bool m) { return m; }
+
+inline bool any(mask m)
+{
+	for (int i = 0; i < LANES; i++)
+		if (m.m[i]) return true;
+	return false;
+}
+
+inline bool all(mask m)
+{
+	for (int i = 0; i < LANES; i++)
+		if (!m.m[i]) return false;
+	return true;
+}
+
+#define LANEWISE(f, F) \
+	inline float f(float x) { return F(x); } \
+	inline lanes f(lanes x) \
+	{ \
+		lanes r; \
+		for (int i = 0; i < LANES; i++) r.v[i] = F(x.v[i]); \
+		return r; \
+	}
+
+LANEWISE(sin, std::sin)
+LANEWISE(cos, std::cos)
+LANEWISE(tan, std::tan)
+LANEWISE(exp, std::exp)
+LANEWISE(log, std::log)
+#undef LANEWISE
+
+inline float atan(float y, float x) { return std::atan2(y, x); }
+inline lanes atan(lanes y, lanes x)
+{
+	lanes r;
+	for (int i = 0; i < LANES; i++) r.v[i] = std::atan2(y.v[i], x.v[i]);
+	return r;
+}
+
+inline float pow(float x, float y) { return std::pow(x, y); }
+inline lanes pow(lanes x, lanes y)
+{
+	lanes r;
+	for (int i = 0; i < LANES; i++) r.v[i] = std::pow(x.v[i], y.v[i]);
+	return r;
+}
+
+inline float sqrt(float x) { return std::sqrt(x); }
+inline lanes sqrt(lanes x)
+{
+#ifdef __SSE__
+	for (int i = 0; i < LANES; i += 4) {
+		__m128 q;
+		memcpy(&q, (float *)&x.v + i, sizeof q);
+		q = _mm_sqrt_ps(q);
+		memcpy((float *)&x.v + i, &q, sizeof q);
+	}
+	return x;
+#else
+	for (int i = 0; i < LANES; i++) x.v[i] = std::sqrt(x.v[i]);
+	return x;
+#endif
+}
+
+/*
+ * floor() through an integer conversion, which vectorizes without
+ * SSE4.1. It is exact for |x| < 2^31, which is all the shaders need; the
+ * float version does the same so the two stay identical.
+ */
+inline float floor(float x)
+{
+	float f = (float)(int32_t)x;
+	return f > x ? f - 1.0f : f;
+}
+
+inline lanes floor(lanes x)
+{
+	lane_floats f = __builtin_convertvector(__builtin_convertvector(x.v, lane_ints), lane_floats);
+	return f - __builtin_convertvector((lane_ints)(f > x.v) & 1, lane_floats);
+}
+
+inline float abs(float x) { return std::fabs(x); }
+inline lanes abs(lanes x) { return (lane_floats)((lane_ints)x.v & 0x7fffffff); }
+
+/* GLSL's min() and max(), which return x when the two compare equal. */
+inline float min(float x, float y) { return y < x ? y : x; }
+inline float max(float x, float y) { return x < y ? y : x; }
+inline lanes min(lanes x, lanes y) { return lane_floats(y.v < x.v ? y.v : x.v); }
+inline lanes max(lanes x, lanes y) { return lane_floats(x.v < y.v ? y.v : x.v); }
+
+/* The scalar type S, but not deduced, so that literals convert to it. */
+template<typename S> struct same { typedef S type; };
+#define SCALAR typename same<S>::type
+
+template<typename S> S fract(S x) { return x - floor(x); }
+template<typename S> S clamp(S x, SCALAR lo, SCALAR hi) { return min(max(x, lo), hi); }
+template<typename S> S mix(S x, S y, SCALAR a) { return x * (S(1.0f) - a) + y * a; }
+template<typename S> S step(SCALAR edge, S x) { return select(x < edge, S(0.0f), S(1.0f)); }
+
+template<typename S> S smoothstep(SCALAR e0, SCALAR e1, S x)
+{
+	S t = clamp((x - e0) / (e1 - e0), 0.0f, 1.0f);
+	return t * t * (S(3.0f) - S(2.0f) * t);
+}
+
+template<typename S> struct tvec2 {
+	S x, y;
+
+	tvec2() : x(), y() {}
+	explicit tvec2(SCALAR s) : x(s), y(s) {}
+	tvec2(SCALAR x, SCALAR y) : x(x), y(y) {}
+	template<typename T> explicit tvec2(const tvec2<T> &v) : x(v.x), y(v.y) {}
+
+	S &operator[](int i) { return (&x)[i]; }
+	const S &operator[](int i) const { return (&x)[i]; }
+};
+
+template<typename S> struct tvec3 {
+	S x, y, z;
+
+	tvec3() : x(), y(), z() {}
+	explicit tvec3(SCALAR s) : x(s), y(s), z(s) {}
+	tvec3(SCALAR x, SCALAR y, SCALAR z) : x(x), y(y), z(z) {}
+	tvec3(const tvec2<S> &v, SCALAR z) : x(v.x), y(v.y), z(z) {}
+	template<typename T> explicit tvec3(const tvec3<T> &v) : x(v.x), y(v.y), z(v.z) {}
+
+	S &operator[](int i) { return (&x)[i]; }
+	const S &operator[](int i) const { return (&x)[i]; }
+	tvec2<S> xy() const { return tvec2<S>(x, y); }
+};
+
+template<typename S> struct tvec4 {
+	S x, y, z, w;
+
+	tvec4() : x(), y(), z(), w() {}
+	tvec4(SCALAR x, SCALAR y, SCALAR z, SCALAR w) : x(x), y(y), z(z), w(w) {}
+	tvec4(const tvec3<S> &v, SCALAR w) : x(v.x), y(v.y), z(v.z), w(w) {}
+
+	tvec3<S> rgb() const { return tvec3<S>(x, y, z); }
+};
+
+/* Column major, like GLSL: mat2(a, b, c, d) has columns (a, b) and (c, d). */
+template<typename S> struct tmat2 {
+	tvec2<S> c0, c1;
+
+	tmat2(SCALAR a, SCALAR b, SCALAR c, SCALAR d) : c0(a, b), c1(c, d) {}
+};
+
+/* A row vector times a matrix, which is what v *= m means in GLSL. */
+template<typename S> tvec2<S> operator*(tvec2<S> v, tmat2<S> m)
+{
+	return tvec2<S>(v.x * m.c0.x + v.y * m.c0.y, v.x * m.c1.x + v.y * m.c1.y);
+}
+
+template<typename S> tvec2<S> &operator*=(tvec2<S> &v, tmat2<S> m) { return v = v * m; }
+
+/* Builds a vector like a from f(i) for each component i. */
+template<typename S, typename F> tvec2<S> each(const tvec2<S> &, F f) { return tvec2<S>(f(0), f(1)); }
+template<typename S, typename F> tvec3<S> each(const tvec3<S> &, F f) { return tvec3<S>(f(0), f(1), f(2)); }
+
+template<typename S> S dot(tvec2<S> a, tvec2<S> b) { return a.x * b.x + a.y * b.y; }
+template<typename S> S dot(tvec3<S> a, tvec3<S> b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+#define EACH(e) each(a, [&](int i) { return e; })
+#define VECTOR_OPS(V) \
+	template<typename S> V<S> operator+(V<S> a, V<S> b) { return EACH(a[i] + b[i]); } \
+	template<typename S> V<S> operator-(V<S> a, V<S> b) { return EACH(a[i] - b[i]); } \
+	template<typename S> V<S> operator*(V<S> a, V<S> b) { return EACH(a[i] * b[i]); } \
+	template<typename S> V<S> operator/(V<S> a, V<S> b) { return EACH(a[i] / b[i]); } \
+	template<typename S> V<S> operator+(V<S> a, SCALAR b) { return EACH(a[i] + b); } \
+	template<typename S> V<S> operator-(V<S> a, SCALAR b) { return EACH(a[i] - b); } \
+	template<typename S> V<S> operator*(V<S> a, SCALAR b) { return EACH(a[i] * b); } \
+	template<typename S> V<S> operator/(V<S> a, SCALAR b) { return EACH(a[i] / b); } \
+	template<typename S> V<S> operator*(SCALAR b, V<S> a) { return EACH(b * a[i]); } \
+	template<typename S> V<S> operator-(V<S> a) { return EACH(-a[i]); } \
+	template<typename S> V<S> &operator+=(V<S> &a, V<S> b) { return a = a + b; } \
+	template<typename S> V<S> &operator-=(V<S> &a, V<S> b) { return a = a - b; } \
+	template<typename S> V<S> &operator*=(V<S> &a, V<S> b) { return a = a * b; } \
+	template<typename S> V<S> &operator+=(V<S> &a, SCALAR b) { return a = a + b; } \
+	template<typename S> V<S> &operator-=(V<S> &a, SCALAR b) { return a = a - b; } \
+	template<typename S> V<S> &operator*=(V<S> &a, SCALAR b) { return a = a * b; } \
+	template<typename S> V<S> &operator/=(V<S> &a, SCALAR b) { return a = a / b; } \
+	template<typename S> V<S> abs(V<S> a) { return EACH(abs(a[i])); } \
+	template<typename S> V<S> sin(V<S> a) { return EACH(sin(a[i])); } \
+	template<typename S> V<S> exp(V<S> a) { return EACH(exp(a[i])); } \
+	template<typename S> V<S> log(V<S> a) { return EACH(log(a[i])); } \
+	template<typename S> V<S> fract(V<S> a) { return EACH(fract(a[i])); } \
+	template<typename S> V<S> pow(V<S> a, V<S> b) { return EACH(pow(a[i], b[i])); } \
+	template<typename S> V<S> max(V<S> a, SCALAR b) { return EACH(max(a[i], b)); } \
+	template<typename S> V<S> min(V<S> a, SCALAR b) { return EACH(min(a[i], b)); } \
+	template<typename S, typename M> V<S> select(M m, V<S> a, V<S> b) \
+		{ return each(a, [&](int i) { return select(m, a[i], b[i]); }); } \
+	template<typename S> S length(V<S> a) { return sqrt(dot(a, a)); } \
+	template<typename S> V<S> normalize(V<S> a) { return a / length(a); }
+
+VECTOR_OPS(tvec2)
+VECTOR_OPS(tvec3)
+#undef VECTOR_OPS
+#undef EACH
+#undef SCALAR
+
+}
+
+#endif
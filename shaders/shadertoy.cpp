@@ -0,0 +1,601 @@
+/*
+ * Runs the ShaderToy programs in this directory on the CPU, so they can
+ * be rendered without a GPU. Each shader is ported from its .fs file
+ * nearly line for line onto the GLSL types in glsl.h, and frames are
+ * written through the same image sinks as fractal.cpp.
+ *
+ * Build it from the top of the repository with something like
+ *
+ *	g++ -std=c++11 -O2 -pthread shaders/shadertoy.cpp -o shadertoy
+ *
+ * (glm has to be on the include path for the sinks).
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+#include "glsl.h"
+#include "../sinks.h"
+
+using namespace glsl;
+
+struct march_stats {
+	std::atomic<long long> rays{0}, steps{0};
+};
+
+/*
+ * The uniforms are the same for every pixel, so they stay plain floats;
+ * only fragCoord and whatever is computed from it is per lane.
+ *
+ * The last two aren't ShaderToy's: they control the ray marchers, see
+ * march() below.
+ */
+struct uniforms {
+	tvec3<float> iResolution;
+	float iGlobalTime;
+
+	float epsilon;
+	march_stats *stats;
+};
+
+/*
+ * The ray marchers of sphere_field and voxel_field step t += d * 0.5 a
+ * fixed number of times, and their look depends on that: most rays are
+ * still far from any surface after the last step, and the fog comes from
+ * how far they got. So the march can't be over-relaxed or started from a
+ * shared cone distance without changing the image.
+ *
+ * What can be cut is the tail of rays that have hit: near a surface each
+ * half step shrinks d geometrically, so once |d| < epsilon the remaining
+ * steps move t by about epsilon at most. A packet stops when all of its
+ * lanes have converged (converged lanes keep stepping until then, exactly
+ * as in the shader), and epsilon = 0 runs the full march.
+ *
+ * For the same reason animations aren't sped up by starting rays where
+ * the last frame hit. The scenes are static, so the empty spheres a
+ * march steps through could certify where the next frame's ray may
+ * start, but only rays that hit can use that, and a packet only gets
+ * faster if all 8 of its rays did: most packets have a fog lane that
+ * marches to the end anyway. Also, a ray that passes close to a surface
+ * before hitting another crawls past the first one in the full march and
+ * may run out of steps, which a late start would skip. Tried on 30
+ * frames of voxel_field, it saved 2% of the steps and was slower with
+ * the bookkeeping.
+ */
+template<typename S, typename SDF>
+S march(const uniforms &u, tvec3<S> o, tvec3<S> r, int steps, SDF map)
+{
+	S t = 0.0f;
+	int i = 0;
+
+	while (i < steps) {
+		S d = map(o + r * t);
+		t += d * 0.5f;
+		i++;
+
+		if (all(glsl::abs(d) < u.epsilon)) break;
+	}
+
+	u.stats->rays += sizeof (S) / sizeof (float);
+	u.stats->steps += (long long)i * (sizeof (S) / sizeof (float));
+	return t;
+}
+
+#define GLSL_TYPES(S) \
+	typedef tvec2<S> vec2; \
+	typedef tvec3<S> vec3; \
+	typedef tvec4<S> vec4; \
+	typedef tmat2<S> mat2;
+
+/* floating_polygon.fs */
+template<typename S> struct floating_polygon {
+	GLSL_TYPES(S)
+
+	static constexpr float PI = 3.14159265359f;
+	static constexpr float TAU = 6.28318530718f;
+
+	static S polygon(vec2 st, float sides, float radius)
+	{
+		S a = atan(st.x, st.y) + PI;
+		float r = TAU / sides;
+		S d = cos(floor(0.5f + a / r) * r - a) * length(st);
+		return smoothstep(radius - 0.002f, radius + 0.002f, d);
+	}
+
+	static void mainImage(const uniforms &u, vec4 &fragColor, vec2 fragCoord)
+	{
+		vec2 res = vec2(u.iResolution.x, u.iResolution.y);
+		vec2 vignetteuv = (fragCoord / res - 0.5f) * -1.0f * 0.25f;
+		vec2 uv = fragCoord / res - 0.5f;
+		uv.x *= u.iResolution.x / u.iResolution.y;
+		uv.y += std::sin(u.iGlobalTime * 0.25f) * 0.025f;
+
+		vec3 cola = vec3(0.0f);
+		vec3 colb = vec3(1.0f);
+		float angle = PI / 4.0f;
+		uv *= mat2(std::cos(angle), -std::sin(angle), std::sin(angle), std::cos(angle));
+		vec3 col = vec3(0.0f);
+
+		S d = polygon(uv, 4.0f, 0.3f);
+		col += colb * d;
+		d -= 0.5f; d *= -1.0f; d += 0.5f;
+		col += cola * d;
+		col *= (length(vignetteuv) - 0.5f) * -1.0f + 0.5f;
+
+		fragColor = vec4(col * col * col, 1.0f);
+	}
+};
+
+/* metaball_field.fs, without its unused z and a. */
+template<typename S> struct metaball_field {
+	GLSL_TYPES(S)
+
+	static constexpr float M_PI_ = 3.1415926f;
+	static constexpr float SCALE = 5.0f;
+	static constexpr float SPEED = 2.0f;
+	static constexpr float XOFF = 3.0f;
+	static constexpr float YOFF = 2.0f;
+
+	static vec2 standard(vec2 z)
+	{
+		z *= SCALE;
+		z -= SCALE / 2.0f;
+		return z;
+	}
+
+	static tmat2<float> rotation(float theta)
+	{
+		return tmat2<float>(std::cos(theta), -std::sin(theta), std::sin(theta), std::cos(theta));
+	}
+
+	static void mainImage(const uniforms &u, vec4 &fragColor, vec2 fragCoord)
+	{
+		vec2 res = vec2(u.iResolution.x, u.iResolution.y);
+		vec2 uv = fragCoord / res;
+		uv = standard(uv);
+		vec2 oguv = uv;
+
+		uv.x *= u.iResolution.x / u.iResolution.y;
+		uv = exp(log(uv) / 2.0f);
+
+		vec2 unmodifieduv = uv;
+
+		float the = -u.iGlobalTime;
+		tmat2<float> rotat = rotation(the);
+		uv *= mat2(rotat.c0.x, rotat.c0.y, rotat.c1.x, rotat.c1.y);
+
+		float theta = 0.0f;
+		tvec2<float> mouse = tvec2<float>(std::sin(u.iGlobalTime * SPEED) * (1.0f / SCALE) * (SCALE + XOFF),
+			std::cos(u.iGlobalTime * SPEED) * (1.0f / SCALE) * (SCALE + YOFF));
+		mouse *= rotation(theta);
+
+		theta += M_PI_ / 2.0f;
+		tvec2<float> mouse2 = mouse;
+		mouse2 *= rotation(theta);
+
+		theta += M_PI_ / 2.0f;
+		tvec2<float> mouse3 = mouse;
+		mouse3 *= rotation(theta);
+
+		theta += M_PI_ / 2.0f;
+		tvec2<float> mouse4 = mouse;
+		mouse4 *= rotation(theta);
+
+		S temp = pow(length(uv - vec2(mouse)), 1.5f);
+		S temp2 = pow(length(uv - vec2(mouse2)), 1.5f);
+		S temp3 = pow(length(uv - vec2(mouse3)), 1.5f);
+		S temp4 = pow(length(uv - vec2(mouse4)), 1.5f);
+		S col = temp * temp2 * temp3 * temp4;
+
+		S vignette = ((length(unmodifieduv) - 0.5f) * -1.0f) + 0.5f;
+		vignette += 0.5f;
+
+		col *= vignette;
+		vec3 r = vec3(col, col * 3.0f, col / 2.0f);
+		r -= 0.5f; r *= -1.0f; r += 0.5f;
+		r = pow(r, vec3(-0.8f));
+
+		S stripe = select(fract(fragCoord.x / 2.0f) <= 0.25f, S(1.0f), S(0.0f));
+		r.y *= stripe;
+		r.z *= stripe;
+
+		r.x *= sin(fragCoord.x / u.iResolution.x);
+
+		S vig = (((length(oguv) / 2.0f) - 0.5f) * -1.0f) + 0.5f;
+		vig += 0.5f;
+		r *= vig;
+
+		fragColor = vec4(r, 1.0f);
+	}
+};
+
+/* sphere_field.fs */
+template<typename S> struct sphere_field {
+	GLSL_TYPES(S)
+
+	static constexpr int NUM_ITERATIONS = 24;
+
+	static S map(vec3 p)
+	{
+		vec3 q = fract(p) * 2.0f - 1.0f;
+
+		return length(q) - 0.25f;
+	}
+
+	static S trace(const uniforms &u, vec3 o, vec3 r)
+	{
+		return march(u, o, r, NUM_ITERATIONS, map);
+	}
+
+	static void mainImage(const uniforms &u, vec4 &fragColor, vec2 fragCoord)
+	{
+		vec2 res = vec2(u.iResolution.x, u.iResolution.y);
+		vec2 uv = fragCoord / res;
+		uv = uv * 2.0f - 1.0f;
+		vec2 unmodifieduv = uv;
+		uv.x *= u.iResolution.x / u.iResolution.y;
+
+		vec3 r = normalize(vec3(uv, std::sin(u.iGlobalTime - 20.0f) / 8.0f));
+		vec3 o = vec3(0.0f, 0.0f, u.iGlobalTime);
+
+		float theta = 3.1415926f / 4.0f;
+		vec2 rxy = r.xy() * mat2(std::cos(theta), -std::sin(theta), std::sin(theta), std::cos(theta));
+		r.x = rxy.x, r.y = rxy.y;
+
+		S t = trace(u, o, r);
+		t -= 2.0f;
+		S fog = 1.0f / (1.0f + t * t * 0.1f);
+		S vignette = ((length(unmodifieduv) - 0.5f) * -1.0f) + 0.5f;
+		vignette += 0.5f; fog *= vignette;
+		vec3 col = vec3(fog / 2.0f, sin(fog), fog * 2.0f);
+
+		fragColor = vec4(col * col * col, 1.0f);
+	}
+};
+
+/*
+ * voxel_field.fs. The middle band is a branch on the pixel, so with
+ * lanes both sides are computed (the band only if some lane is in it)
+ * and picked per lane.
+ */
+template<typename S> struct voxel_field {
+	GLSL_TYPES(S)
+
+	static constexpr float PI = 3.1415926f;
+	static constexpr int CRISPNESS = 32;
+	static constexpr float SPEED = 0.25f;
+
+	static S box(vec3 p)
+	{
+		vec3 q = fract(p) * 2.0f - 1.0f;
+		vec3 d = abs(q) - vec3(0.25f);
+		return min(max(d.x, max(d.y, d.z)), S(0.0f)) + length(max(d, 0.0f));
+	}
+
+	static S trace(const uniforms &u, vec3 o, vec3 r)
+	{
+		return march(u, o, r, CRISPNESS, box);
+	}
+
+	static S fog_at(const uniforms &u, vec2 uv)
+	{
+		vec3 r = normalize(vec3(uv, 1.0f));
+		float theta = PI / 4.0f;
+		vec2 rxy = r.xy() * mat2(std::cos(theta), -std::sin(theta), std::sin(theta), std::cos(theta));
+		r.x = rxy.x, r.y = rxy.y;
+		vec3 o = vec3(0.0f, 0.0f, u.iGlobalTime);
+		S t = trace(u, o, r);
+		t -= 2.0f;
+		S fog = 1.0f / (1.0f + t * t * 0.1f);
+
+		return fog;
+	}
+
+	static void mainImage(const uniforms &u, vec4 &fragColor, vec2 fragCoord)
+	{
+		vec2 res = vec2(u.iResolution.x, u.iResolution.y);
+		vec2 uv = fragCoord / res - 0.5f;
+		S vignette = ((length(uv) - 0.5f) * -1.0f) + 0.5f;
+		vignette += 0.5f;
+
+		uv.x *= u.iResolution.x / u.iResolution.y;
+
+		S fog = fog_at(u, uv);
+		fog *= vignette;
+		fog *= 0.5f;
+		vec3 cubes = vec3(fog / 2.0f, fog * 2.0f, sin(fog));
+
+		vec3 gradient = vec3(uv + 0.5f, 0.5f);
+		vec3 col = gradient + cubes * length(uv);
+
+		auto band = (uv.x < 0.25f) && (uv.x > -0.25f);
+		if (any(band)) {
+			float a = u.iGlobalTime * SPEED;
+			S fog = fog_at(u, uv * mat2(std::cos(a), -std::sin(a), std::sin(a), std::cos(a)));
+			fog *= vignette;
+			fog *= 0.5f;
+			vec3 cubes = vec3(fog / 2.0f, fog * 3.0f, sin(fog));
+			vec2 inverseuv = vec2(uv.x, uv.y - 1.0f * -1.0f + 1.0f);
+			cubes *= vec3(inverseuv + 0.25f, 1.0f);
+			cubes *= 0.5f;
+			col = select(band, cubes + length(uv * 1.25f) * gradient, col);
+		}
+
+		fragColor = vec4(col * col * col, 1.0f);
+	}
+};
+
+typedef void (*packet_fn)(const uniforms &u, tvec4<lanes> &fragColor, tvec2<lanes> fragCoord);
+typedef void (*pixel_fn)(const uniforms &u, tvec4<float> &fragColor, tvec2<float> fragCoord);
+
+struct shader {
+	const char *name;
+	packet_fn packet;
+	pixel_fn pixel;
+};
+
+#define SHADER(s) { #s, s<lanes>::mainImage, s<float>::mainImage }
+
+const shader shaders[] = {
+	SHADER(floating_polygon),
+	SHADER(metaball_field),
+	SHADER(sphere_field),
+	SHADER(voxel_field),
+};
+
+#define TILE 32
+
+/*
+ * Renders one frame. Threads take TILE x TILE tiles off a shared counter,
+ * and within a tile pixels are shaded LANES at a time along each row
+ * (the last packet of a row is padded and the padding thrown away).
+ * ShaderToy puts fragCoord at pixel centers with y going up, while the
+ * image is stored top row first.
+ */
+void render_frame(const shader &s, const uniforms &u, std::vector<glm::vec3> &image,
+	int nthreads, bool scalar)
+{
+	int width = u.iResolution.x, height = u.iResolution.y;
+	int tw = (width + TILE - 1) / TILE, th = (height + TILE - 1) / TILE;
+	std::atomic<int> next(0);
+
+	auto store = [&](int x, int y, float r, float g, float b) {
+		image[(height - 1 - y) * width + x] = glm::vec3(r, g, b) * 255.0f;
+	};
+
+	auto worker = [&]() {
+		for (int t; (t = next++) < tw * th; ) {
+			int x0 = t % tw * TILE, y0 = t / tw * TILE;
+			int x1 = std::min(x0 + TILE, width), y1 = std::min(y0 + TILE, height);
+
+			for (int y = y0; y < y1; y++) {
+				if (scalar) {
+					for (int x = x0; x < x1; x++) {
+						tvec4<float> c;
+						s.pixel(u, c, tvec2<float>(x + 0.5f, y + 0.5f));
+						store(x, y, c.x, c.y, c.z);
+					}
+					continue;
+				}
+
+				for (int x = x0; x < x1; x += LANES) {
+					tvec2<lanes> coord(0.0f, y + 0.5f);
+					for (int i = 0; i < LANES; i++)
+						coord.x.v[i] = x + i + 0.5f;
+
+					tvec4<lanes> c;
+					s.packet(u, c, coord);
+					for (int i = 0; i < LANES && x + i < x1; i++)
+						store(x + i, y, c.x[i], c.y[i], c.z[i]);
+				}
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < nthreads; i++)
+		threads.emplace_back(worker);
+	worker();
+
+	for (auto &th : threads) th.join();
+}
+
+/*
+ * How far image is from ref, as the largest difference in any channel
+ * and as PSNR, both on the 8-bit output.
+ */
+void compare(const std::vector<glm::vec3> &image, const std::vector<glm::vec3> &ref, int &worst, double &psnr)
+{
+	double err = 0.0;
+	worst = 0;
+
+	for (size_t i = 0; i < image.size(); i++) {
+		for (int c = 0; c < 3; c++) {
+			int d = std::abs(to_byte(image[i][c]) - to_byte(ref[i][c]));
+			worst = std::max(worst, d);
+			err += d * d;
+		}
+	}
+
+	err /= image.size() * 3;
+	psnr = err == 0.0 ? INFINITY : 10.0 * log10(255.0 * 255.0 / err);
+}
+
+/*
+ * Whether path is safe to use as the printf pattern for frame numbers:
+ * one %d, with at most a 0 flag and a width, and no other % but %%.
+ */
+bool frame_pattern(const char *path)
+{
+	int conversions = 0;
+
+	for (const char *p = path; *p; p++) {
+		if (*p != '%') continue;
+		if (p[1] == '%') {
+			p++;
+			continue;
+		}
+
+		p++;
+		if (*p == '0') p++;
+		while (*p >= '0' && *p <= '9') p++;
+		if (*p != 'd') return false;
+		conversions++;
+	}
+
+	return conversions == 1;
+}
+
+void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0 << " [options]\n"
+		"  --shader NAME            one of:";
+	for (const shader &s : shaders) std::cerr << " " << s.name;
+	std::cerr << "\n"
+		"  --width N, --height N    image size\n"
+		"  --time T                 iGlobalTime of the first frame\n"
+		"  --frames N, --fps N      render N frames, 1 / fps seconds apart\n"
+		"  --threads N              worker threads\n"
+		"  --scalar                 shade one pixel at a time instead of in lanes\n"
+		"  --epsilon E              stop marching rays closer than E to a surface\n"
+		"  --check                  compare against the full march\n"
+		"  --format FORMAT          p3, p6, ppm16, png or tiff\n"
+		"  -o FILE                  output file; with several frames, a printf\n"
+		"                           pattern for the frame number like out%04d.ppm\n";
+}
+
+int main(int argc, char **argv)
+{
+	const shader *s = &shaders[0];
+	int width = 640, height = 360;
+	float time = 0.0f;
+	int frames = 1, fps = 30;
+	int nthreads = std::thread::hardware_concurrency();
+	bool scalar = false;
+	bool check = false;
+	float epsilon = 1e-4f;
+	const char *format = "p6";
+	const char *path = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--shader") && i + 1 < argc) {
+			const char *name = argv[++i];
+			s = NULL;
+			for (const shader &t : shaders)
+				if (!strcmp(t.name, name)) s = &t;
+
+			if (!s) {
+				std::cerr << "unknown shader '" << name << "'" << std::endl;
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--width") && i + 1 < argc) {
+			width = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--height") && i + 1 < argc) {
+			height = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--time") && i + 1 < argc) {
+			time = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+			frames = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+			fps = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			nthreads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--scalar")) {
+			scalar = true;
+		} else if (!strcmp(argv[i], "--epsilon") && i + 1 < argc) {
+			epsilon = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--check")) {
+			check = true;
+		} else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+			format = argv[++i];
+		} else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			path = argv[++i];
+		} else {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (width < 1 || height < 1 || frames < 1 || fps < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (nthreads < 1) nthreads = 1;
+
+	std::string ext = sink_extension(format);
+	std::string default_path = std::string(s->name) + (frames > 1 ? "%04d." : ".") + ext;
+	if (!path) path = default_path.c_str();
+
+	if (frames > 1 && !frame_pattern(path)) {
+		std::cerr << "with several frames, -o takes one %d for the frame number, "
+			"like out%04d.ppm, and no other %" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<glm::vec3> image(width * height), ref;
+	march_stats stats, full;
+	uniforms u;
+	u.iResolution = tvec3<float>(width, height, 1.0f);
+	u.epsilon = epsilon;
+	u.stats = &stats;
+
+	for (int f = 0; f < frames; f++) {
+		u.iGlobalTime = time + (float)f / fps;
+		render_frame(*s, u, image, nthreads, scalar);
+
+		if (check) {
+			uniforms v = u;
+			v.epsilon = 0.0f;
+			v.stats = &full;
+			ref.resize(image.size());
+			render_frame(*s, v, ref, nthreads, scalar);
+
+			int worst;
+			double psnr;
+			compare(image, ref, worst, psnr);
+			std::cout << "against the full march: " << psnr << " dB, off by at most "
+				<< worst << "/255" << std::endl;
+		}
+
+		char name[4096];
+		if (frames > 1) snprintf(name, sizeof name, path, f);
+		else snprintf(name, sizeof name, "%s", path);
+
+		image_sink *sink = new_sink(format);
+		if (!sink) {
+			std::cerr << "unknown output format '" << format << "'" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		bool ok = sink->open(name, width, height);
+		if (ok) {
+			sink->write_rows(image.data(), height);
+			ok = sink->close();
+		}
+		delete sink;
+
+		if (!ok) {
+			std::cerr << "couldn't write " << name << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		std::cout << name << std::endl;
+	}
+
+	if (stats.rays)
+		std::cout << (double)stats.steps / stats.rays << " steps per ray"
+			<< (full.rays ? ", " + std::to_string((double)full.steps / full.rays) + " for the full march" : "")
+			<< std::endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,452 @@
+/*
+ * Image sinks shared by fractal.cpp and the shader runner in shaders/.
+ * Colors are glm::vec3 on a 0..255 scale.
+ */
+
+#ifndef SINKS_H
+#define SINKS_H
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+#include "glm/glm.hpp"
+
+/*
+ * Rows arrive in order, a band of rows at a time, and each band is
+ * converted into one buffer and written with a single call, so
+ * formatting never happens per pixel on the stream.
+ */
+class image_sink {
+public:
+	virtual ~image_sink() {}
+	virtual bool open(const char *path, int w, int h) = 0;
+	virtual void write_rows(const glm::vec3 *rows, int n) = 0;
+	virtual bool close() = 0;
+};
+
+/* The same truncating conversion the original P3 writer used. */
+static inline uint8_t to_byte(float c)
+{
+	int v = (int)c;
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline uint16_t to_word(float c)
+{
+	int v = (int)(c * 257.0f + 0.5f);
+	return v < 0 ? 0 : v > 65535 ? 65535 : v;
+}
+
+/* With a NULL path the file is kept in memory, for contents() after close(). */
+class file_sink : public image_sink {
+protected:
+	std::ofstream file;
+	std::stringbuf memory;
+	std::ostream out{NULL};
+	std::vector<uint8_t> buf;
+	int width = 0, height = 0;
+
+	void flush()
+	{
+		out.write((const char *)buf.data(), buf.size());
+		buf.clear();
+	}
+
+public:
+	bool open(const char *path, int w, int h)
+	{
+		width = w, height = h;
+		if (!path) {
+			out.rdbuf(&memory);
+			return true;
+		}
+
+		file.open(path, std::ios::binary);
+		out.rdbuf(file.rdbuf());
+		return file.good();
+	}
+
+	bool close()
+	{
+		flush();
+		out.flush();
+		if (file.is_open()) file.close();
+		return !out.fail() && !file.fail();
+	}
+
+	std::string contents() const
+	{
+		return memory.str();
+	}
+};
+
+/* The old ASCII format, kept for anything that still expects it. */
+class p3_sink : public file_sink {
+public:
+	bool open(const char *path, int w, int h)
+	{
+		if (!file_sink::open(path, w, h)) return false;
+		out << "P3\n" << w << " " << h << "\n255\n";
+		return true;
+	}
+
+	void write_rows(const glm::vec3 *rows, int n)
+	{
+		char num[16];
+
+		for (int i = 0; i < n * width; i++) {
+			const glm::vec3 &c = rows[i];
+			int len = snprintf(num, sizeof num, "%d %d %d\n", to_byte(c.r), to_byte(c.g), to_byte(c.b));
+			buf.insert(buf.end(), num, num + len);
+		}
+
+		flush();
+	}
+};
+
+class p6_sink : public file_sink {
+public:
+	bool open(const char *path, int w, int h)
+	{
+		if (!file_sink::open(path, w, h)) return false;
+		out << "P6\n" << w << " " << h << "\n255\n";
+		return true;
+	}
+
+	void write_rows(const glm::vec3 *rows, int n)
+	{
+		buf.resize(n * width * 3);
+		uint8_t *p = buf.data();
+
+		for (int i = 0; i < n * width; i++) {
+			*p++ = to_byte(rows[i].r);
+			*p++ = to_byte(rows[i].g);
+			*p++ = to_byte(rows[i].b);
+		}
+
+		flush();
+	}
+};
+
+/* 16 bits per channel, big-endian as the PPM spec requires. */
+class ppm16_sink : public file_sink {
+public:
+	bool open(const char *path, int w, int h)
+	{
+		if (!file_sink::open(path, w, h)) return false;
+		out << "P6\n" << w << " " << h << "\n65535\n";
+		return true;
+	}
+
+	void write_rows(const glm::vec3 *rows, int n)
+	{
+		buf.resize(n * width * 6);
+		uint8_t *p = buf.data();
+
+		for (int i = 0; i < n * width; i++) {
+			for (int c = 0; c < 3; c++) {
+				uint16_t v = to_word(rows[i][c]);
+				*p++ = v >> 8;
+				*p++ = v & 0xFF;
+			}
+		}
+
+		flush();
+	}
+};
+
+/*
+ * An 8-bit RGB PNG without zlib. The zlib stream uses stored deflate
+ * blocks, so it is only a few bytes per 64K larger than the raw pixels
+ * (still about a quarter of the P3 size), and every band becomes one
+ * IDAT chunk. The stream is terminated with an empty final block on
+ * close since we can't know which band is the last one in advance.
+ */
+class png_sink : public file_sink {
+	uint32_t crc_table[256];
+	uint32_t adler_a = 1, adler_b = 0;
+
+	uint32_t crc(const uint8_t *p, size_t len, uint32_t c = 0xFFFFFFFF)
+	{
+		for (size_t i = 0; i < len; i++)
+			c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+		return c;
+	}
+
+	void adler(const uint8_t *p, size_t len)
+	{
+		for (size_t i = 0; i < len; i++) {
+			adler_a = (adler_a + p[i]) % 65521;
+			adler_b = (adler_b + adler_a) % 65521;
+		}
+	}
+
+	static void put32(std::vector<uint8_t> &v, uint32_t x)
+	{
+		v.push_back(x >> 24);
+		v.push_back(x >> 16);
+		v.push_back(x >> 8);
+		v.push_back(x);
+	}
+
+	/* Appends a chunk whose payload is buf[start..] to buf in place. */
+	void chunk(const char *type, size_t start)
+	{
+		uint32_t len = buf.size() - start;
+		std::vector<uint8_t> head;
+		put32(head, len);
+		head.insert(head.end(), type, type + 4);
+		buf.insert(buf.begin() + start, head.begin(), head.end());
+
+		uint32_t c = crc(&buf[start + 4], len + 4);
+		put32(buf, c ^ 0xFFFFFFFF);
+	}
+
+	void stored(const uint8_t *p, size_t len, bool last)
+	{
+		do {
+			size_t n = len < 65535 ? len : 65535;
+			buf.push_back(last && n == len);
+			buf.push_back(n & 0xFF);
+			buf.push_back(n >> 8);
+			buf.push_back(~n & 0xFF);
+			buf.push_back((~n >> 8) & 0xFF);
+			buf.insert(buf.end(), p, p + n);
+			p += n, len -= n;
+		} while (len);
+	}
+
+public:
+	png_sink()
+	{
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			crc_table[n] = c;
+		}
+	}
+
+	bool open(const char *path, int w, int h)
+	{
+		if (!file_sink::open(path, w, h)) return false;
+
+		static const uint8_t sig[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		buf.insert(buf.end(), sig, sig + sizeof sig);
+
+		size_t start = buf.size();
+		put32(buf, w);
+		put32(buf, h);
+		buf.push_back(8);       /* bit depth */
+		buf.push_back(2);       /* truecolor */
+		buf.push_back(0);       /* deflate */
+		buf.push_back(0);       /* adaptive filtering */
+		buf.push_back(0);       /* no interlace */
+		chunk("IHDR", start);
+
+		start = buf.size();
+		buf.push_back(0x78);    /* zlib header: deflate, 32K window */
+		buf.push_back(0x01);
+		chunk("IDAT", start);
+
+		flush();
+		return true;
+	}
+
+	void write_rows(const glm::vec3 *rows, int n)
+	{
+		std::vector<uint8_t> raw(n * (1 + width * 3));
+		uint8_t *p = raw.data();
+
+		for (int y = 0; y < n; y++) {
+			*p++ = 0;       /* filter type: none */
+			for (int x = 0; x < width; x++) {
+				const glm::vec3 &c = rows[y * width + x];
+				*p++ = to_byte(c.r);
+				*p++ = to_byte(c.g);
+				*p++ = to_byte(c.b);
+			}
+		}
+
+		adler(raw.data(), raw.size());
+
+		size_t start = buf.size();
+		stored(raw.data(), raw.size(), false);
+		chunk("IDAT", start);
+		flush();
+	}
+
+	bool close()
+	{
+		size_t start = buf.size();
+		stored(NULL, 0, true);
+		put32(buf, (adler_b << 16) | adler_a);
+		chunk("IDAT", start);
+		chunk("IEND", buf.size());
+		return file_sink::close();
+	}
+};
+
+/*
+ * An uncompressed 8-bit RGB TIFF, written a strip of STRIP rows at a
+ * time as the rows come in; the strip offsets and the directory go at
+ * the end, and the header is patched to point at them on close. Images
+ * too big for 32-bit offsets are written as BigTIFF, so a poster of any
+ * size streams out with only one strip buffered.
+ */
+class tiff_sink : public file_sink {
+	static const int STRIP = 64;
+
+	struct field {
+		uint16_t tag, type;
+		std::vector<uint64_t> values;
+	};
+
+	bool big = false;
+	uint64_t at = 0;                        /* bytes written so far */
+	std::vector<uint8_t> strip;
+	int pending = 0;                        /* rows in strip */
+	std::vector<uint64_t> offsets, sizes;
+
+	void put(uint64_t x, int bytes)
+	{
+		for (int i = 0; i < bytes; i++)
+			buf.push_back(x >> 8 * i);
+	}
+
+	void write_buf()
+	{
+		at += buf.size();
+		flush();
+	}
+
+	void end_strip()
+	{
+		offsets.push_back(at);
+		sizes.push_back(strip.size());
+		out.write((const char *)strip.data(), strip.size());
+		at += strip.size();
+		strip.clear();
+		pending = 0;
+	}
+
+	static int type_size(uint16_t type)
+	{
+		return type == 3 ? 2 : type == 4 ? 4 : 8;
+	}
+
+public:
+	bool open(const char *path, int w, int h)
+	{
+		if (!file_sink::open(path, w, h)) return false;
+
+		big = (uint64_t)w * h * 3 > 0xF0000000ULL;
+		buf.push_back('I');
+		buf.push_back('I');
+		put(big ? 43 : 42, 2);
+		if (big) put(8, 2), put(0, 2);
+		put(0, big ? 8 : 4);    /* the directory's offset, patched on close */
+		write_buf();
+		return true;
+	}
+
+	void write_rows(const glm::vec3 *rows, int n)
+	{
+		for (int y = 0; y < n; y++) {
+			size_t start = strip.size();
+			strip.resize(start + width * 3);
+			uint8_t *p = &strip[start];
+
+			for (int x = 0; x < width; x++) {
+				const glm::vec3 &c = rows[(size_t)y * width + x];
+				*p++ = to_byte(c.r);
+				*p++ = to_byte(c.g);
+				*p++ = to_byte(c.b);
+			}
+
+			if (++pending == STRIP) end_strip();
+		}
+	}
+
+	bool close()
+	{
+		if (pending) end_strip();
+
+		const uint16_t SHORT = 3, LONG = 4, OFFSET = big ? 16 : 4;
+		std::vector<field> fields = {
+			{ 256, LONG, { (uint64_t)width } },
+			{ 257, LONG, { (uint64_t)height } },
+			{ 258, SHORT, { 8, 8, 8 } },            /* bits per sample */
+			{ 259, SHORT, { 1 } },                  /* no compression */
+			{ 262, SHORT, { 2 } },                  /* RGB */
+			{ 273, OFFSET, offsets },
+			{ 277, SHORT, { 3 } },                  /* samples per pixel */
+			{ 278, LONG, { (uint64_t)STRIP } },
+			{ 279, OFFSET, sizes },
+			{ 284, SHORT, { 1 } },                  /* interleaved */
+		};
+
+		/* Values that don't fit in a directory entry go first. */
+		const int slot = big ? 8 : 4;
+		std::vector<uint64_t> where(fields.size());
+		for (size_t i = 0; i < fields.size(); i++) {
+			const field &f = fields[i];
+			if (f.values.size() * type_size(f.type) <= (size_t)slot) continue;
+
+			if (at % 2) put(0, 1), write_buf();
+			where[i] = at;
+			for (uint64_t v : f.values) put(v, type_size(f.type));
+			write_buf();
+		}
+
+		if (at % 2) put(0, 1), write_buf();
+		uint64_t directory = at;
+
+		put(fields.size(), big ? 8 : 2);
+		for (size_t i = 0; i < fields.size(); i++) {
+			const field &f = fields[i];
+			put(f.tag, 2);
+			put(f.type, 2);
+			put(f.values.size(), slot);
+
+			size_t size = f.values.size() * type_size(f.type);
+			if (size > (size_t)slot) {
+				put(where[i], slot);
+			} else {
+				for (uint64_t v : f.values) put(v, type_size(f.type));
+				put(0, slot - size);
+			}
+		}
+		put(0, slot);           /* no next directory */
+		write_buf();
+
+		out.seekp(big ? 8 : 4);
+		put(directory, slot);
+		flush();
+		return file_sink::close();
+	}
+};
+
+inline image_sink *new_sink(const char *format)
+{
+	if (!strcmp(format, "p3"))    return new p3_sink;
+	if (!strcmp(format, "p6"))    return new p6_sink;
+	if (!strcmp(format, "ppm16")) return new ppm16_sink;
+	if (!strcmp(format, "png"))   return new png_sink;
+	if (!strcmp(format, "tiff"))  return new tiff_sink;
+	return NULL;
+}
+
+/* The file name extension for a format, of new_sink()'s or the video ones. */
+inline const char *sink_extension(const char *format)
+{
+	if (!strcmp(format, "p3") || !strcmp(format, "p6") || !strcmp(format, "ppm16")) return "ppm";
+	return format;
+}
+
+#endif
@@ -4,52 +4,205 @@
 #include <inttypes.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ * Hash functions come in pairs, one for strings and one for integers,
+ * and a table hashes its keys with the pair it was made with and a seed
+ * of its own. new_table() uses word_hasher and a random seed, so which
+ * keys collide in a table can't be worked out in advance to flood it;
+ * the hashes stored in the slots are only good within their table.
+ * cached, if a hasher has it, makes a table's hash of a symbol from
+ * the hash the symbol keeps, instead of hashing its name again.
+ */
+struct hasher {
+	const char *name;
+	uint64_t (*str)(const char *s, uint64_t seed);
+	uint64_t (*integer)(int i, uint64_t seed);
+	uint64_t (*cached)(uint64_t hash, uint64_t seed);
+};
 
 /*
  * The FNV-1a hash function.
  * http://www.isthe.com/chongo/tech/comp/fnv/index.html
  */
 
-#define HASH_INIT ((0x84222325UL << sizeof (uint32_t)) | 0xcbf29ce4UL)
+#define HASH_INIT ((uint64_t)0xcbf29ce484222325)
 #define FNV_PRIME ((uint64_t)0x100000001b3)
 
 uint64_t hash(const char *buf, size_t len, uint64_t h)
 {
 	for (size_t i = 0; i < len; i++) {
-		h ^= (uint64_t)buf[i];
+		h ^= (uint8_t)buf[i];
 		h *= FNV_PRIME;
 	}
 
 	return h;
 }
 
-uint64_t hash_str(const char *s)
+uint64_t hash_str(const char *s, uint64_t seed)
+{
+	return hash(s, strlen(s), HASH_INIT ^ seed);
+}
+
+uint64_t hash_int(int i, uint64_t seed)
 {
-	return hash(s, strlen(s), HASH_INIT);
+	return hash((char *)&i, sizeof i, HASH_INIT ^ seed);
 }
 
-uint64_t hash_int(int i)
+const struct hasher fnv1a_hasher = { "fnv1a", hash_str, hash_int, NULL };
+
+/*
+ * Word at a time, in the style of wyhash: every 8 bytes of the string
+ * are xored into the state, which is multiplied by a constant, and the
+ * high and low halves of the 128-bit product folded together. The last
+ * 0 to 7 bytes make one more word, from two overlapping 4-byte loads or
+ * up to three single bytes (which, with the length, still tell the
+ * strings apart), so nothing past the terminator is read. The strlen()
+ * first is cheaper than finding the terminator in the words here.
+ *
+ * Strings are hashed with the process' seed, and a table mixes that
+ * with its own seed, so a symbol can keep the first hash for every
+ * table. Without the process' seed nobody knows which strings collide
+ * in it either.
+ */
+#define MIX_K0 ((uint64_t)0xa0761d6478bd642f)
+#define MIX_K1 ((uint64_t)0xe7037ed1a0b428db)
+#define MIX_K2 ((uint64_t)0x8ebc6af09c88c6e3)
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
 {
-	return hash((char *)&i, sizeof i, HASH_INIT);
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
 }
 
+static uint64_t seed_of_process;
+
+/*
+ * The process' seed, from /dev/urandom (or the clock, where there's
+ * none), made when first needed.
+ */
+static __attribute__((noinline)) uint64_t make_process_seed(void)
+{
+	uint64_t s, none = 0;
+	FILE *f = fopen("/dev/urandom", "rb");
+	if (!f || fread(&s, sizeof s, 1, f) != 1) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		s = mix(ts.tv_sec ^ MIX_K2, ts.tv_nsec ^ (uintptr_t)&ts);
+	}
+	if (f) fclose(f);
+	s |= 1;
+
+	if (!__atomic_compare_exchange_n(&seed_of_process, &none, s, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		s = none;
+	return s;
+}
+
+static inline uint64_t process_seed(void)
+{
+	uint64_t s = __atomic_load_n(&seed_of_process, __ATOMIC_RELAXED);
+	return s ? s : make_process_seed();
+}
+
+/* A seed per table: the process' seed mixed with a count of the tables made. */
+static uint64_t new_seed(void)
+{
+	static uint64_t count;
+	return mix(process_seed() ^ __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED), MIX_K0);
+}
+
+/*
+ * The string's hash with the process' seed, and its length. The last
+ * multiply is left to word_hash_cached(), which xors in a table's seed
+ * first.
+ */
+static inline uint64_t word_hash_raw(const char *s, size_t *length)
+{
+	uint64_t h = process_seed() ^ MIX_K0, w;
+	size_t len = strlen(s), i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, 8);
+		h = mix(h ^ w, MIX_K1);
+	}
+
+	/* The last 0 to 7 bytes, each read once if there are up to 4. */
+	const unsigned char *t = (const unsigned char *)s + i;
+	size_t n = len - i;
+	if (n >= 4) {
+		uint32_t a, b;
+		memcpy(&a, t, 4);
+		memcpy(&b, t + n - 4, 4);
+		w = a | (uint64_t)b << 32;
+	} else {
+		w = n ? (uint64_t)t[0] << 16 | (uint64_t)t[n / 2] << 8 | t[n - 1] : 0;
+	}
+	h = mix(h ^ w, MIX_K1);
+
+	if (length) *length = len;
+	return h ^ len;
+}
+
+uint64_t word_hash_cached(uint64_t hash, uint64_t seed)
+{
+	return mix(hash ^ seed, MIX_K2);
+}
+
+uint64_t word_hash_str(const char *s, uint64_t seed)
+{
+	return word_hash_cached(word_hash_raw(s, NULL), seed);
+}
+
+/* Multiply and fold, like a string of one word. */
+uint64_t word_hash_int(int i, uint64_t seed)
+{
+	return mix((uint32_t)i ^ seed ^ MIX_K0, MIX_K1);
+}
+
+const struct hasher word_hasher = { "word", word_hash_str, word_hash_int, word_hash_cached };
+
+/*
+ * An interned string: intern() returns the same symbol for equal
+ * strings, so two symbols are equal if their pointers are, and a symbol
+ * keeps its length and word hash. A key that is a symbol is hashed by a
+ * table with one multiply instead of a pass over the string, and only
+ * compared by pointer with other symbols. Symbols are for keys used
+ * over and over: they live as long as the process.
+ */
+struct symbol {
+	uint64_t hash;
+	size_t len;
+	char name[];
+};
+
+struct symbol *intern(const char *s);
+
 struct value {
 	enum {
 		VAL_INT,
-		VAL_STR
+		VAL_STR,
+		VAL_SYM
 	} type;
 
 	union {
 		int integer;
 		char *string;
+		struct symbol *symbol;
 	} d;
 };
 
-uint64_t hash_value(const struct value v)
+uint64_t hash_value(const struct hasher *hf, uint64_t seed, const struct value v)
 {
 	switch (v.type) {
-	case VAL_INT: return hash_int(v.d.integer);
-	case VAL_STR: return hash_str(v.d.string);
+	case VAL_INT: return hf->integer(v.d.integer, seed);
+	case VAL_STR: return hf->str(v.d.string, seed);
+	case VAL_SYM:
+		if (hf->cached) return hf->cached(v.d.symbol->hash, seed);
+		return hf->str(v.d.symbol->name, seed);
 	}
 
 	return -1; // silence warning
@@ -65,103 +218,1109 @@ void print_value(struct value *v)
 	switch (v->type) {
 	case VAL_INT: printf("%d\n", v->d.integer); break;
 	case VAL_STR: printf("%s\n", v->d.string); break;
+	case VAL_SYM: printf("%s\n", v->d.symbol->name); break;
 	}
 }
 
+/*
+ * A symbol and a string are equal if the string is its name: of the
+ * name's length, so that memcmp() reads no further than either ends.
+ */
 bool val_cmp(struct value l, struct value r)
 {
+	if (l.type == VAL_STR && r.type == VAL_SYM) {
+		struct value t = l;
+		l = r, r = t;
+	}
+
+	if (l.type == VAL_SYM && r.type == VAL_SYM) return l.d.symbol == r.d.symbol;
+	if (l.type == VAL_SYM && r.type == VAL_STR)
+		return strlen(r.d.string) == l.d.symbol->len
+			&& memcmp(r.d.string, l.d.symbol->name, l.d.symbol->len) == 0;
 	if (l.type != r.type) return false;
 
 	switch (l.type) {
 	case VAL_INT: return l.d.integer == r.d.integer; break;
 	case VAL_STR: return strcmp(l.d.string, r.d.string) == 0; break;
+	case VAL_SYM: break;
 	}
 
 	return false; // silence warning
 }
 
-#define TABLE_SIZE 32
+/*
+ * Open addressing, laid out like a Swiss table: slots come in groups of
+ * GROUP, and a separate array of control bytes holds, for every slot,
+ * EMPTY or the low 7 bits of its key's hash. A probe compares a whole
+ * group of control bytes at once (one SSE2 compare on x86-64) and only
+ * compares keys where those 7 bits match. The rest of the hash picks the
+ * first group to look in; after that groups are probed by triangular
+ * numbers, which visits every group of a power-of-two table. There is
+ * no removal, so the first group with an empty slot ends a probe. The
+ * table doubles when it would get more than 7/8 full.
+ *
+ * Values live in the slots, so the pointers table_add() and
+ * table_lookup() return are only good until the next table_add(). The
+ * strings of keys and values (but not symbols) are copied into the
+ * table's arena: chunks of at least ARENA_CHUNK bytes, filled front to
+ * back and all freed with the table. So once the table has grown to
+ * size, adding doesn't allocate, and freeing it is a handful of free()s.
+ * Replacing a string value reuses its space when the new string is no
+ * longer; a table whose values keep being replaced by longer strings
+ * keeps growing its arena until it is freed.
+ */
+#define GROUP 16
+#define EMPTY 0x80
+#define ARENA_CHUNK 65536
+
+struct chunk {
+	struct chunk *next;
+	size_t used, size;
+	char data[];
+};
 
 struct table {
-	struct bucket {
-		uint64_t *h;
-		struct value *key;
-		struct value **val;
-		size_t len;
-	} bucket[TABLE_SIZE];
+	uint8_t *ctrl;
+	struct slot {
+		uint64_t h;
+		struct value key;
+		struct value val;
+	} *slot;
+	size_t cap, len;        /* cap is a power of two, and at least GROUP */
+	struct chunk *arena;    /* the one being filled first */
+	const struct hasher *hf;
+	uint64_t seed;
 };
 
 struct value *table_lookup(struct table *t, struct value key);
 struct value *table_add(struct table *t, struct value key, struct value v);
 struct table *new_table();
+struct table *new_table_hashed(const struct hasher *hf, uint64_t seed);
 
-struct table *new_table()
+#ifdef __x86_64__
+#include <immintrin.h>
+
+/* Bit i is set if control byte i of the group is c. */
+static inline uint32_t group_match(const uint8_t *group, uint8_t c)
+{
+	__m128i g = _mm_loadu_si128((const __m128i *)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+}
+#else
+static inline uint32_t group_match(const uint8_t *group, uint8_t c)
+{
+	uint32_t m = 0;
+	for (int i = 0; i < GROUP; i++)
+		m |= (uint32_t)(group[i] == c) << i;
+	return m;
+}
+#endif
+
+static void table_alloc(struct table *t, size_t cap)
+{
+	t->cap = cap;
+	t->ctrl = malloc(cap);
+	t->slot = malloc(cap * sizeof *t->slot);
+	memset(t->ctrl, EMPTY, cap);
+}
+
+/* The first group with an empty slot on h's probe sequence. */
+static struct slot *table_free_slot(struct table *t, uint64_t h)
+{
+	size_t mask = t->cap / GROUP - 1;
+
+	for (size_t g = (h >> 7) & mask, step = 1; ; g = (g + step++) & mask) {
+		uint32_t empty = group_match(t->ctrl + g * GROUP, EMPTY);
+		if (empty) {
+			size_t i = g * GROUP + __builtin_ctz(empty);
+			t->ctrl[i] = h & 0x7F;
+			return t->slot + i;
+		}
+	}
+}
+
+static void table_grow(struct table *t)
+{
+	struct table old = *t;
+	table_alloc(t, old.cap * 2);
+
+	for (size_t i = 0; i < old.cap; i++)
+		if (old.ctrl[i] != EMPTY)
+			*table_free_slot(t, old.slot[i].h) = old.slot[i];
+
+	free(old.ctrl);
+	free(old.slot);
+}
+
+/* size bytes from an arena, at a multiple of align (at most 8). */
+static void *arena_alloc(struct chunk **arena, size_t size, size_t align)
+{
+	struct chunk *c = *arena;
+	size_t at = c ? (c->used + align - 1) & ~(align - 1) : 0;
+
+	if (!c || at > c->size || c->size - at < size) {
+		size_t n = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+		c = malloc(sizeof *c + n);
+		c->next = *arena;
+		c->size = n;
+		*arena = c;
+		at = 0;
+	}
+
+	c->used = at + size;
+	return c->data + at;
+}
+
+static void arena_free(struct chunk **arena)
+{
+	while (*arena) {
+		struct chunk *next = (*arena)->next;
+		free(*arena);
+		*arena = next;
+	}
+}
+
+/* v with its string, if any, copied into the arena (symbols stay where they are). */
+static struct value arena_own(struct chunk **arena, struct value v)
+{
+	if (v.type == VAL_STR) {
+		size_t len = strlen(v.d.string) + 1;
+		v.d.string = memcpy(arena_alloc(arena, len, 1), v.d.string, len);
+	}
+	return v;
+}
+
+struct table *new_table_hashed(const struct hasher *hf, uint64_t seed)
 {
 	struct table *t = malloc(sizeof *t);
-	memset(t, 0, sizeof *t);
+	t->len = 0;
+	t->arena = NULL;
+	t->hf = hf;
+	t->seed = seed;
+	table_alloc(t, GROUP);
 	return t;
 }
 
+struct table *new_table()
+{
+	return new_table_hashed(&word_hasher, new_seed());
+}
+
 void free_table(struct table *t)
 {
-	for (size_t i = 0; i < TABLE_SIZE; i++) {
-		if (t->bucket[i].h)   free(t->bucket[i].h);
-		if (t->bucket[i].key) free(t->bucket[i].key);
-		if (t->bucket[i].val) {
-			for (size_t j = 0; j < t->bucket[i].len; j++) {
-				if (t->bucket[i].val) free(t->bucket[i].val[j]);
-			}
-			free(t->bucket[i].val);
+	arena_free(&t->arena);
+	free(t->ctrl);
+	free(t->slot);
+	free(t);
+}
+
+/* The key's slot, or NULL if it isn't in the table. */
+static struct slot *table_find(struct table *t, struct value key, uint64_t h)
+{
+	size_t mask = t->cap / GROUP - 1;
+
+	for (size_t g = (h >> 7) & mask, step = 1; ; g = (g + step++) & mask) {
+		const uint8_t *group = t->ctrl + g * GROUP;
+
+		for (uint32_t m = group_match(group, h & 0x7F); m; m &= m - 1) {
+			struct slot *s = t->slot + g * GROUP + __builtin_ctz(m);
+			if (s->h == h && val_cmp(s->key, key)) return s;
 		}
+
+		if (group_match(group, EMPTY)) return NULL;
 	}
+}
 
-	free(t);
+/* Replaces a value, with a string in the old one's space if it fits there. */
+static void table_replace(struct table *t, struct value *old, struct value v)
+{
+	if (old->type == VAL_STR && v.type == VAL_STR) {
+		size_t len = strlen(v.d.string);
+		if (len <= strlen(old->d.string)) {
+			memmove(old->d.string, v.d.string, len + 1);
+			return;
+		}
+	}
+
+	*old = arena_own(&t->arena, v);
 }
 
 struct value *table_add(struct table *t, struct value key, struct value v)
 {
-	uint64_t h = hash_value(key);
-	struct value *o = table_lookup(t, key);
-	if (o) return *o = v, o;
+	uint64_t h = hash_value(t->hf, t->seed, key);
+	struct slot *s = table_find(t, key, h);
+	if (s) return table_replace(t, &s->val, v), &s->val;
 
-	int idx = h % TABLE_SIZE;
-	struct bucket *b = t->bucket + idx;
+	if ((t->len + 1) * 8 > t->cap * 7) table_grow(t);
 
-	b->h   = realloc(b->h,   sizeof b->h[0]   * (b->len + 1));
-	b->val = realloc(b->val, sizeof b->val[0] * (b->len + 1));
-	b->key = realloc(b->key, sizeof b->key[0] * (b->len + 1));
+	s = table_free_slot(t, h);
+	s->h = h;
+	s->key = arena_own(&t->arena, key);
+	s->val = arena_own(&t->arena, v);
 
-	b->h  [b->len] = h;
-	b->key[b->len] = key;
-	b->val[b->len] = malloc(sizeof (struct value));
-	b->val[b->len]->type = v.type;
-	b->val[b->len]->d = v.d;
-
-	b->len++;
-	return b->val[b->len - 1];
+	t->len++;
+	return &s->val;
 }
 
 struct value *table_lookup(struct table *t, struct value key)
 {
-	uint64_t h = hash_value(key);
-	int idx = h % TABLE_SIZE;
+	struct slot *s = table_find(t, key, hash_value(t->hf, t->seed, key));
+	return s ? &s->val : NULL;
+}
 
-	struct bucket *b = t->bucket + idx;
+/*
+ * A table for many threads at once, laid out like struct table and with
+ * the same lookup and add. Lookups take no locks and write nothing
+ * shared. An add takes the lock of one of STRIPES stripes, picked by the
+ * top bits of the key's hash, so adds of keys in different stripes go
+ * on in parallel; each stripe has its own arena for keys.
+ *
+ * A value is copied into a block of its own on every add, and the slot
+ * points at the copy, so replacing a value is a single pointer store.
+ * The value it replaces is retired, and freed by epochs (below) once
+ * no lookup can still be reading it. So the pointers ctable_lookup()
+ * and ctable_add() return show the value as it was, and are good
+ * until the value is replaced; to keep using them after that, look up
+ * and use them between ctable_read_begin() and ctable_read_end().
+ *
+ * A control byte goes from EMPTY to BUSY while an add fills in its slot,
+ * and then to the hash bits, stored last; a lookup only reads a slot
+ * after it reads those bits.
+ *
+ * Growing doesn't stop anything. The add that finds the newest array
+ * full links one twice its size after it, and from then on every add
+ * also moves one group of the old array to the new one, under the locks
+ * of the keys it moves. A moved slot's control byte becomes MOVED (and
+ * an empty one SEALED, so nothing more is added to the old array), after
+ * the key is in the new one, so a lookup that goes through the old
+ * array and then the new one finds every key. When the last group has
+ * moved the new array becomes the current one.
+ *
+ * Lookups may still be reading an old array or value, so they are
+ * freed by epochs: a thread in a ctable call or read section has
+ * published the global epoch it started in, and once every such thread
+ * is in the current one, the epoch moves on. Something unlinked in
+ * epoch e can't be seen by anyone once the epoch is e + 2. A thread in
+ * a long read section holds the epoch back, and with it the freeing of
+ * every replaced value.
+ */
+#define STRIPES 64
+#define STRIPE_BITS 6
+#define BUSY 0x81
+#define MOVED 0x82
+#define SEALED 0x83
+#define CTABLE_CAP 1024
+#define RETIRE_BATCH 64
+
+/* A value of a ctable, with its string if it has one. */
+struct cvalue {
+	struct value v;                 /* first, so a pointer to it is one to the cvalue */
+	struct cvalue *retired;
+	uint64_t epoch;                 /* when it was retired */
+	char string[];
+};
+
+struct carray {
+	uint8_t *ctrl;
+	struct cslot {
+		uint64_t h;
+		struct value key;
+		struct value *val;
+	} *slot;
+	size_t cap, limit;              /* limit of adds, 7/8 of cap */
+	size_t reserved;                /* adds let in, including the old array's */
+	size_t next_group, moved;       /* groups handed out and done moving */
+	struct carray *next;            /* the one being grown into */
+	struct carray *retired;
+	uint64_t epoch;                 /* when it was retired */
+};
+
+struct ctable {
+	struct carray *cur;
+	struct stripe {
+		pthread_mutex_t lock;
+		struct chunk *arena;
+		struct cvalue *retired; /* replaced values, newest first */
+		size_t waiting;         /* how many */
+	} __attribute__((aligned(64))) stripe[STRIPES];
+	pthread_mutex_t grow;           /* for next and retired */
+	struct carray *retired;
+	uint64_t seed;
+};
+
+struct value *ctable_lookup(struct ctable *t, struct value key);
+struct value *ctable_add(struct ctable *t, struct value key, struct value v);
+struct ctable *new_ctable();
+void free_ctable(struct ctable *t);
+void ctable_read_begin(void);
+void ctable_read_end(void);
+
+/* Every thread that has used a ctable, in the list for good. */
+static struct epoch_thread {
+	uint64_t epoch;                 /* 2e + 1 in a call in epoch e, else 0 */
+	bool used;
+	struct epoch_thread *next;
+} __attribute__((aligned(64))) *epoch_threads;
+
+static uint64_t epoch_now = 1;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_thread *epoch_self;
+static __thread int epoch_depth;
 
-	for (size_t i = 0; i < b->len; i++) {
-		if (b->h[i] == h && val_cmp(b->key[i], key)) {
-			return b->val[i];
+static void epoch_exit(void *self)
+{
+	__atomic_store_n(&((struct epoch_thread *)self)->used, false, __ATOMIC_RELEASE);
+}
+
+static void epoch_init(void)
+{
+	pthread_key_create(&epoch_key, epoch_exit);
+}
+
+static void epoch_enter(void)
+{
+	struct epoch_thread *self = epoch_self;
+	if (epoch_depth++) return;
+
+	if (!self) {
+		pthread_once(&epoch_once, epoch_init);
+		pthread_mutex_lock(&epoch_lock);
+		for (self = epoch_threads; self && __atomic_load_n(&self->used, __ATOMIC_ACQUIRE); self = self->next)
+			;
+		if (!self) {
+			self = aligned_alloc(64, sizeof *self);
+			self->epoch = 0;
+			self->next = epoch_threads;
+			__atomic_store_n(&epoch_threads, self, __ATOMIC_RELEASE);
 		}
+		self->used = true;
+		pthread_mutex_unlock(&epoch_lock);
+		pthread_setspecific(epoch_key, self);
+		epoch_self = self;
 	}
 
+	__atomic_store_n(&self->epoch, 2 * __atomic_load_n(&epoch_now, __ATOMIC_SEQ_CST) + 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void epoch_leave(void)
+{
+	if (--epoch_depth) return;
+	__atomic_store_n(&epoch_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Values looked up or added by this thread until ctable_read_end() stay
+ * good until then, even if they are replaced. Sections nest.
+ */
+void ctable_read_begin(void)
+{
+	epoch_enter();
+}
+
+void ctable_read_end(void)
+{
+	epoch_leave();
+}
+
+/* Moves the epoch on if every thread in a call is in this one. */
+static uint64_t epoch_advance(void)
+{
+	uint64_t e = __atomic_load_n(&epoch_now, __ATOMIC_SEQ_CST);
+
+	for (struct epoch_thread *p = __atomic_load_n(&epoch_threads, __ATOMIC_ACQUIRE); p; p = p->next) {
+		uint64_t in = __atomic_load_n(&p->epoch, __ATOMIC_SEQ_CST);
+		if (in && in != 2 * e + 1) return e;
+	}
+
+	__atomic_compare_exchange_n(&epoch_now, &e, e + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&epoch_now, __ATOMIC_SEQ_CST);
+}
+
+static void carray_free(struct carray *a)
+{
+	free(a->ctrl);
+	free(a->slot);
+	free(a);
+}
+
+/* Frees the retired arrays nobody can be reading any more. */
+static void ctable_reclaim(struct ctable *t)
+{
+	pthread_mutex_lock(&t->grow);
+	uint64_t e = epoch_advance();
+	for (struct carray **p = &t->retired; *p; ) {
+		struct carray *a = *p;
+		if (a->epoch + 2 <= e) {
+			__atomic_store_n(p, a->retired, __ATOMIC_RELAXED);
+			carray_free(a);
+		} else {
+			p = &a->retired;
+		}
+	}
+	pthread_mutex_unlock(&t->grow);
+}
+
+static struct value *cvalue_new(struct value v)
+{
+	size_t len = v.type == VAL_STR ? strlen(v.d.string) + 1 : 0;
+	struct cvalue *cv = malloc(sizeof *cv + len);
+
+	cv->v = v;
+	if (len) cv->v.d.string = memcpy(cv->string, v.d.string, len);
+	return &cv->v;
+}
+
+/* Frees the stripe's replaced values nobody can be reading any more; under its lock. */
+static void stripe_reclaim(struct stripe *st)
+{
+	uint64_t e = epoch_advance();
+	for (struct cvalue **p = &st->retired; *p; ) {
+		struct cvalue *cv = *p;
+		if (cv->epoch + 2 <= e) {
+			*p = cv->retired;
+			free(cv);
+			__atomic_store_n(&st->waiting, st->waiting - 1, __ATOMIC_RELAXED);
+		} else {
+			p = &cv->retired;
+		}
+	}
+}
+
+/*
+ * group_match() for control bytes other threads change: the group is
+ * read as two atomic words, which are plain loads on x86-64 too.
+ */
+static inline uint32_t cgroup_match(const uint8_t *group, uint8_t c)
+{
+	uint64_t lo = __atomic_load_n((const uint64_t *)group, __ATOMIC_RELAXED);
+	uint64_t hi = __atomic_load_n((const uint64_t *)group + 1, __ATOMIC_RELAXED);
+#ifdef __x86_64__
+	__m128i g = _mm_set_epi64x(hi, lo);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+	uint8_t bytes[GROUP];
+	memcpy(bytes, &lo, 8);
+	memcpy(bytes + 8, &hi, 8);
+	return group_match(bytes, c);
+#endif
+}
+
+static struct carray *carray_new(size_t cap)
+{
+	struct carray *a = calloc(1, sizeof *a);
+	a->cap = cap;
+	a->limit = cap / 8 * 7;
+	a->ctrl = malloc(cap);
+	a->slot = malloc(cap * sizeof *a->slot);
+	memset(a->ctrl, EMPTY, cap);
+	return a;
+}
+
+/* The key's slot in the array, or NULL. */
+static struct cslot *carray_find(struct carray *a, struct value key, uint64_t h)
+{
+	size_t mask = a->cap / GROUP - 1;
+
+	for (size_t g = (h >> 7) & mask, step = 1; step <= mask + 1; g = (g + step++) & mask) {
+		const uint8_t *group = a->ctrl + g * GROUP;
+
+		uint32_t m = cgroup_match(group, h & 0x7F), end = cgroup_match(group, EMPTY) | cgroup_match(group, SEALED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		for (; m; m &= m - 1) {
+			size_t i = g * GROUP + __builtin_ctz(m);
+			if (__atomic_load_n(&a->ctrl[i], __ATOMIC_ACQUIRE) != (h & 0x7F)) continue;
+			struct cslot *s = a->slot + i;
+			if (s->h == h && val_cmp(s->key, key)) return s;
+		}
+
+		if (end) return NULL;
+	}
+
+	return NULL;
+}
+
+/* The key's slot in a or the arrays after it, or NULL. */
+static struct cslot *ctable_find(struct carray *a, struct value key, uint64_t h)
+{
+	for (; a; a = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE)) {
+		struct cslot *s = carray_find(a, key, h);
+		if (s) return s;
+	}
 	return NULL;
 }
 
+/*
+ * Makes an empty slot on h's probe sequence BUSY and returns it, or NULL
+ * once the probe gets to a group that is being moved.
+ */
+static struct cslot *carray_claim(struct carray *a, uint64_t h)
+{
+	size_t mask = a->cap / GROUP - 1;
+
+	for (size_t g = (h >> 7) & mask, step = 1; step <= mask + 1; g = (g + step++) & mask) {
+		uint8_t *group = a->ctrl + g * GROUP;
+
+		for (uint32_t m = cgroup_match(group, EMPTY); m; m &= m - 1) {
+			uint8_t empty = EMPTY;
+			size_t i = g * GROUP + __builtin_ctz(m);
+			if (__atomic_compare_exchange_n(&a->ctrl[i], &empty, BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return a->slot + i;
+		}
+
+		if (cgroup_match(group, MOVED) | cgroup_match(group, SEALED)) return NULL;
+	}
+
+	return NULL;
+}
+
+static void cslot_publish(struct carray *a, struct cslot *s, uint64_t h, struct value key, struct value *val)
+{
+	s->h = h;
+	s->key = key;
+	__atomic_store_n(&s->val, val, __ATOMIC_RELAXED);
+	__atomic_store_n(&a->ctrl[s - a->slot], h & 0x7F, __ATOMIC_RELEASE);
+}
+
+/* Moves one group of cur to the array after it; false if there's none to move. */
+static bool ctable_move(struct ctable *t)
+{
+	struct carray *a = __atomic_load_n(&t->cur, __ATOMIC_ACQUIRE);
+	struct carray *b = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE);
+	if (!b) return false;
+
+	size_t groups = a->cap / GROUP;
+	size_t g = __atomic_fetch_add(&a->next_group, 1, __ATOMIC_RELAXED);
+	if (g >= groups) return false;
+
+	for (size_t i = g * GROUP; i < (g + 1) * GROUP; i++) {
+		uint8_t c = __atomic_load_n(&a->ctrl[i], __ATOMIC_ACQUIRE);
+
+		while (c == BUSY || c == EMPTY) {
+			if (c == EMPTY && __atomic_compare_exchange_n(&a->ctrl[i], &c, SEALED, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				break;
+			if (c == BUSY) {
+				sched_yield();
+				c = __atomic_load_n(&a->ctrl[i], __ATOMIC_ACQUIRE);
+			}
+		}
+		if (c == EMPTY || c == BUSY) continue;
+
+		struct cslot *s = a->slot + i;
+		struct stripe *st = &t->stripe[s->h >> (64 - STRIPE_BITS)];
+		pthread_mutex_lock(&st->lock);
+		cslot_publish(b, carray_claim(b, s->h), s->h, s->key, __atomic_load_n(&s->val, __ATOMIC_RELAXED));
+		__atomic_store_n(&a->ctrl[i], MOVED, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&st->lock);
+	}
+
+	if (__atomic_add_fetch(&a->moved, 1, __ATOMIC_ACQ_REL) == groups) {
+		__atomic_store_n(&t->cur, b, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&t->grow);
+		a->epoch = __atomic_load_n(&epoch_now, __ATOMIC_SEQ_CST);
+		a->retired = t->retired;
+		__atomic_store_n(&t->retired, a, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&t->grow);
+	}
+	return true;
+}
+
+/*
+ * Makes room after a, which has none: finishes moving into it, then
+ * grows it, unless another add already has.
+ */
+static void ctable_make_room(struct ctable *t, struct carray *a)
+{
+	while (__atomic_load_n(&t->cur, __ATOMIC_ACQUIRE) != a) {
+		if (__atomic_load_n(&a->next, __ATOMIC_ACQUIRE)) return;
+		if (!ctable_move(t)) sched_yield();
+	}
+
+	pthread_mutex_lock(&t->grow);
+	if (!a->next) {
+		struct carray *b = carray_new(a->cap * 2);
+		b->reserved = a->limit;
+		__atomic_store_n(&a->next, b, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&t->grow);
+}
+
+struct ctable *new_ctable()
+{
+	struct ctable *t = aligned_alloc(64, sizeof *t);
+	t->cur = carray_new(CTABLE_CAP);
+	for (int i = 0; i < STRIPES; i++) {
+		pthread_mutex_init(&t->stripe[i].lock, NULL);
+		t->stripe[i].arena = NULL;
+		t->stripe[i].retired = NULL;
+		t->stripe[i].waiting = 0;
+	}
+	pthread_mutex_init(&t->grow, NULL);
+	t->retired = NULL;
+	t->seed = new_seed();
+	return t;
+}
+
+/* Only once no other thread is using the table. */
+void free_ctable(struct ctable *t)
+{
+	for (struct carray *a = t->cur, *next; a; a = next) {
+		for (size_t i = 0; i < a->cap; i++)
+			if (a->ctrl[i] < EMPTY) free(a->slot[i].val);
+		next = a->next;
+		carray_free(a);
+	}
+	while (t->retired) {
+		struct carray *next = t->retired->retired;
+		carray_free(t->retired);
+		t->retired = next;
+	}
+	for (int i = 0; i < STRIPES; i++) {
+		struct stripe *st = &t->stripe[i];
+		pthread_mutex_destroy(&st->lock);
+		arena_free(&st->arena);
+		while (st->retired) {
+			struct cvalue *next = st->retired->retired;
+			free(st->retired);
+			st->retired = next;
+		}
+	}
+	pthread_mutex_destroy(&t->grow);
+	free(t);
+}
+
+struct value *ctable_lookup(struct ctable *t, struct value key)
+{
+	uint64_t h = hash_value(&word_hasher, t->seed, key);
+
+	epoch_enter();
+	struct cslot *s = ctable_find(__atomic_load_n(&t->cur, __ATOMIC_ACQUIRE), key, h);
+	struct value *v = s ? __atomic_load_n(&s->val, __ATOMIC_ACQUIRE) : NULL;
+	epoch_leave();
+
+	return v;
+}
+
+struct value *ctable_add(struct ctable *t, struct value key, struct value v)
+{
+	uint64_t h = hash_value(&word_hasher, t->seed, key);
+	struct stripe *st = &t->stripe[h >> (64 - STRIPE_BITS)];
+	struct value *val;
+
+	epoch_enter();
+	for (;;) {
+		pthread_mutex_lock(&st->lock);
+
+		struct carray *a = __atomic_load_n(&t->cur, __ATOMIC_ACQUIRE);
+		struct cslot *s = ctable_find(a, key, h);
+		if (s) {
+			val = cvalue_new(v);
+			struct cvalue *old = (struct cvalue *)__atomic_exchange_n(&s->val, val, __ATOMIC_ACQ_REL);
+			old->epoch = __atomic_load_n(&epoch_now, __ATOMIC_SEQ_CST);
+			old->retired = st->retired;
+			st->retired = old;
+			__atomic_store_n(&st->waiting, st->waiting + 1, __ATOMIC_RELAXED);
+			break;
+		}
+
+		for (struct carray *next; (next = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE)); a = next)
+			;
+		if (__atomic_fetch_add(&a->reserved, 1, __ATOMIC_RELAXED) < a->limit) {
+			val = cvalue_new(v);
+			key = arena_own(&st->arena, key);
+
+			/* an array grown into after a was let in counts a's adds */
+			while (!(s = carray_claim(a, h)))
+				a = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE);
+			cslot_publish(a, s, h, key, val);
+			break;
+		}
+
+		__atomic_fetch_sub(&a->reserved, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&st->lock);
+		ctable_make_room(t, a);
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	ctable_move(t);
+	epoch_leave();
+	if (__atomic_load_n(&t->retired, __ATOMIC_RELAXED)) ctable_reclaim(t);
+	if (__atomic_load_n(&st->waiting, __ATOMIC_RELAXED) >= RETIRE_BATCH) {
+		pthread_mutex_lock(&st->lock);
+		stripe_reclaim(st);
+		pthread_mutex_unlock(&st->lock);
+	}
+
+	return val;
+}
+
 #define STR(x) ((struct value){ VAL_STR, { .string  = x } })
 #define INT(x) ((struct value){ VAL_INT, { .integer  = x } })
+#define SYM(x) ((struct value){ VAL_SYM, { .symbol  = x } })
+
+/*
+ * The symbols are the keys of a table of their own, and live in its
+ * arena. A string is looked up there as a string key, which is equal to
+ * the symbol of that name.
+ */
+struct symbol *intern(const char *s)
+{
+	static struct table *symbols;
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	size_t len;
+	uint64_t hash = word_hash_raw(s, &len);
+	struct symbol *sym;
+
+	pthread_mutex_lock(&lock);
+	if (!symbols) symbols = new_table();
+
+	struct slot *found = table_find(symbols, STR((char *)s), word_hash_cached(hash, symbols->seed));
+	if (found) {
+		sym = found->key.d.symbol;
+	} else {
+		sym = arena_alloc(&symbols->arena, sizeof *sym + len + 1, 8);
+		sym->hash = hash;
+		sym->len = len;
+		memcpy(sym->name, s, len + 1);
+		table_add(symbols, SYM(sym), INT(0));
+	}
+	pthread_mutex_unlock(&lock);
+
+	return sym;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Sorts hashes for counting collisions. */
+static int cmp_hash(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
 
-int main(void)
+/*
+ * How well n hashes spread over a table's groups: the keys that share a
+ * whole hash, the share of n buckets (picked by the same bits as a
+ * table's groups) left empty, which is about 36.8% for a random
+ * function, and the most keys in one bucket.
+ */
+static void bench_spread(const char *what, uint64_t *h, size_t n)
 {
+	size_t buckets = 1, empty = 0, most = 0, same = 0;
+	while (buckets < n) buckets *= 2;
+
+	uint32_t *load = calloc(buckets, sizeof *load);
+	for (size_t i = 0; i < n; i++)
+		load[(h[i] >> 7) & (buckets - 1)]++;
+	for (size_t i = 0; i < buckets; i++) {
+		empty += !load[i];
+		if (load[i] > most) most = load[i];
+	}
+	free(load);
+
+	qsort(h, n, sizeof *h, cmp_hash);
+	for (size_t i = 1; i < n; i++)
+		same += h[i] == h[i - 1];
+
+	printf("  %s: %zu collisions, %.1f%% of %zu buckets empty, at most %zu in one\n",
+		what, same, 100.0 * empty / buckets, buckets, most);
+}
+
+/*
+ * The threads of the concurrent part of --bench: a read-mostly mix of
+ * 95% lookups of random keys and 5% adds replacing their values, on a
+ * ctable or on a struct table behind one mutex, or (with build) adding
+ * a share of the keys to an empty ctable.
+ */
+struct bench_thread {
+	pthread_t thread;
+	struct ctable *ct;
+	struct table *t;
+	pthread_mutex_t *lock;
+	char **names;
+	size_t n, ops, from, to, wrong;
+	bool build, *done;
+	uint64_t rng;
+};
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *b = arg;
+
+	if (b->build) {
+		for (size_t i = b->from; i < b->to; i++)
+			ctable_add(b->ct, STR(b->names[i]), INT((int)i));
+		return NULL;
+	}
+
+	if (b->done) {
+		while (!__atomic_load_n(b->done, __ATOMIC_ACQUIRE)) {
+			ctable_read_begin();
+			struct value *v = ctable_lookup(b->ct, STR(b->names[0]));
+			b->wrong += !v || strncmp(v->d.string, "value ", 6);
+			ctable_read_end();
+			sched_yield();
+		}
+		return NULL;
+	}
+
+	for (size_t op = 0; op < b->ops; op++) {
+		b->rng ^= b->rng << 13, b->rng ^= b->rng >> 7, b->rng ^= b->rng << 17;
+		size_t k = b->rng % b->n;
+		struct value key = STR(b->names[k]), *v;
+		bool add = b->rng >> 58 < 3;
+
+		if (b->ct) {
+			ctable_read_begin();
+			v = add ? ctable_add(b->ct, key, INT((int)k)) : ctable_lookup(b->ct, key);
+			b->wrong += !v || v->d.integer != (int)k;
+			ctable_read_end();
+		} else {
+			pthread_mutex_lock(b->lock);
+			v = add ? table_add(b->t, key, INT((int)k)) : table_lookup(b->t, key);
+			b->wrong += !v || v->d.integer != (int)k;
+			pthread_mutex_unlock(b->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs the read-mostly mix with 1, 2, 4... threads, up to twice the
+ * cores and at least 8, on n string keys, then builds a ctable of n keys
+ * with as many threads, and looks them all up. Then it replaces one
+ * value n times while the other threads look it up.
+ */
+static void bench_threads(char **names, size_t n)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int most = cores * 2 > 8 ? cores * 2 : 8;
+	struct bench_thread *b = calloc(most, sizeof *b);
+
+	struct ctable *ct = new_ctable();
+	struct table *t = new_table();
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	for (size_t i = 0; i < n; i++) {
+		ctable_add(ct, STR(names[i]), INT((int)i));
+		table_add(t, STR(names[i]), INT((int)i));
+	}
+
+	printf("concurrent, %ld cores, %zu string keys, 95%% lookups and 5%% adds:\n", cores, n);
+	for (int threads = 1; threads <= most; threads *= 2) {
+		for (int locked = 0; locked < 2; locked++) {
+			size_t wrong = 0;
+			double start = now();
+			for (int i = 0; i < threads; i++) {
+				b[i] = (struct bench_thread){ .ct = locked ? NULL : ct, .t = t, .lock = &lock,
+					.names = names, .n = n, .ops = n, .rng = 0x9e3779b97f4a7c15 * (i + 1) };
+				pthread_create(&b[i].thread, NULL, bench_thread, &b[i]);
+			}
+			for (int i = 0; i < threads; i++) {
+				pthread_join(b[i].thread, NULL);
+				wrong += b[i].wrong;
+			}
+			double took = now() - start;
+
+			printf("  %d threads, %s: %.2f M operations/s%s\n", threads, locked ? "table and a mutex" : "ctable",
+				threads * n / took * 1e-6, wrong ? ", WRONG RESULTS" : "");
+		}
+	}
+
+	free_ctable(ct);
+	free_table(t);
+
+	for (int threads = 1; threads <= most; threads *= 2) {
+		ct = new_ctable();
+		double start = now();
+		for (int i = 0; i < threads; i++) {
+			b[i] = (struct bench_thread){ .ct = ct, .names = names, .build = true,
+				.from = n * i / threads, .to = n * (i + 1) / threads };
+			pthread_create(&b[i].thread, NULL, bench_thread, &b[i]);
+		}
+		for (int i = 0; i < threads; i++)
+			pthread_join(b[i].thread, NULL);
+		double took = now() - start;
+
+		size_t wrong = 0;
+		for (size_t i = 0; i < n; i++) {
+			struct value *v = ctable_lookup(ct, STR(names[i]));
+			wrong += !v || v->d.integer != (int)i;
+		}
+		for (size_t i = n; i < 2 * n; i++)
+			wrong += ctable_lookup(ct, STR(names[i])) != NULL;
+
+		printf("  building a ctable of %zu keys with %d threads: %.1f ns per add%s\n", n, threads,
+			took * 1e9 / n, wrong ? ", WRONG RESULTS" : "");
+		free_ctable(ct);
+	}
+
+	/*
+	 * Replaced values are freed, not kept until free_ctable(): replacing
+	 * one key's string n times while the other threads keep looking it
+	 * up leaves some waiting for readers to move on, but not a share of
+	 * n, and none past a batch once they have stopped.
+	 */
+	ct = new_ctable();
+	bool done = false;
+	int readers = most - 1;
+	size_t wrong = 0, waiting = 0;
+	struct stripe *st = &ct->stripe[hash_value(&word_hasher, ct->seed, STR(names[0])) >> (64 - STRIPE_BITS)];
+
+	ctable_add(ct, STR(names[0]), STR("value 0"));
+	for (int i = 0; i < readers; i++) {
+		b[i] = (struct bench_thread){ .ct = ct, .names = names, .done = &done };
+		pthread_create(&b[i].thread, NULL, bench_thread, &b[i]);
+	}
+
+	double start = now();
+	for (size_t i = 0; i < n; i++) {
+		char value[32];
+		snprintf(value, sizeof value, "value %zu", i);
+		ctable_add(ct, STR(names[0]), STR(value));
+		if (st->waiting > waiting) waiting = st->waiting;
+	}
+	double took = now() - start;
+
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < readers; i++) {
+		pthread_join(b[i].thread, NULL);
+		wrong += b[i].wrong;
+	}
+	for (int i = 0; i < 3; i++)
+		ctable_add(ct, STR(names[0]), STR("value"));
+
+	printf("  replacing one value %zu times with %d threads reading it: %.1f ns each, "
+		"at most %zu waiting to be freed, %zu after%s\n", n, readers, took * 1e9 / n, waiting, st->waiting,
+		wrong || waiting > n / 2 || st->waiting > RETIRE_BATCH ? ", WRONG RESULTS" : "");
+	free_ctable(ct);
+
+	free(b);
+}
+
+/*
+ * --bench [N]: for each hasher, adds N integer keys to a table, then N
+ * string keys to another and the same N as symbols to a third, and times
+ * the adds, looking up every key, and looking up N keys that aren't
+ * there. Then it builds and frees N / 100
+ * tables of 100 string keys and values, like short-lived tables built
+ * per request. Then it times hashing strings of a few lengths alone,
+ * and how the hashes of the keys spread. Then it runs bench_threads().
+ */
+void bench(size_t n)
+{
+	const struct hasher *hasher[] = { &fnv1a_hasher, &word_hasher };
+
+	char **names = malloc(2 * n * sizeof *names);
+	for (size_t i = 0; i < 2 * n; i++) {
+		names[i] = malloc(24);
+		snprintf(names[i], 24, "key%zu", i);
+	}
+
+	struct symbol **symbols = malloc(2 * n * sizeof *symbols);
+	double interning = now();
+	for (size_t i = 0; i < 2 * n; i++)
+		symbols[i] = intern(names[i]);
+	printf("interning %zu names: %.1f ns each\n", 2 * n, (now() - interning) * 1e9 / (2 * n));
+
+	for (size_t k = 0; k < sizeof hasher / sizeof *hasher; k++) {
+		const struct hasher *hf = hasher[k];
+		printf("%s:\n", hf->name);
+
+		for (int kind = 0; kind < 3; kind++) {
+			struct table *t = new_table_hashed(hf, new_seed());
+			size_t wrong = 0;
+
+#define KEY(i) (kind == 2 ? SYM(symbols[i]) : kind ? STR(names[i]) : INT((int)(i)))
+			double start = now();
+			for (size_t i = 0; i < n; i++)
+				table_add(t, KEY(i), INT((int)i));
+
+			double added = now();
+			for (size_t i = 0; i < n; i++) {
+				struct value *v = table_lookup(t, KEY(i));
+				wrong += !v || v->d.integer != (int)i;
+			}
+
+			double hits = now();
+			for (size_t i = n; i < 2 * n; i++)
+				wrong += table_lookup(t, KEY(i)) != NULL;
+
+			double misses = now();
+#undef KEY
+
+			printf("  %zu %s keys: add %.1f ns, hit %.1f ns, miss %.1f ns%s\n", n,
+				kind == 2 ? "symbol" : kind ? "string" : "integer",
+				(added - start) * 1e9 / n, (hits - added) * 1e9 / n, (misses - hits) * 1e9 / n,
+				wrong ? ", WRONG RESULTS" : "");
+			free_table(t);
+		}
+
+		size_t tables = n / 100 ? n / 100 : 1, keys = n < 100 ? n : 100;
+		double start = now();
+		for (size_t r = 0; r < tables; r++) {
+			struct table *t = new_table_hashed(hf, new_seed());
+			for (size_t i = 0; i < keys; i++)
+				table_add(t, STR(names[i]), STR(names[n + i]));
+			free_table(t);
+		}
+		printf("  %zu tables of %zu string keys: %.1f ns per table\n", tables, keys, (now() - start) * 1e9 / tables);
+
+		static const size_t lengths[] = { 7, 16, 64, 1024 };
+		for (size_t l = 0; l < sizeof lengths / sizeof *lengths; l++) {
+			char *s = malloc(lengths[l] + 1);
+			for (size_t i = 0; i < lengths[l]; i++)
+				s[i] = 'a' + i % 26;
+			s[lengths[l]] = 0;
+
+			size_t times = 64 * n / (lengths[l] + 8);
+			uint64_t sink = 0;
+			double begin = now();
+			for (size_t i = 0; i < times; i++)
+				sink += hf->str(s, sink);
+			double took = now() - begin;
+
+			printf("  hashing %zu-byte strings: %.1f ns, %.2f GB/s%s\n", lengths[l], took * 1e9 / times,
+				lengths[l] * times / took * 1e-9, sink == 1 ? " " : "");
+			free(s);
+		}
+
+		uint64_t *h = malloc(n * sizeof *h), seed = new_seed();
+		for (size_t i = 0; i < n; i++)
+			h[i] = hf->str(names[i], seed);
+		bench_spread("string keys", h, n);
+		for (size_t i = 0; i < n; i++)
+			h[i] = hf->integer((int)i, seed);
+		bench_spread("integer keys", h, n);
+		for (size_t i = 0; i < n; i++)
+			h[i] = hf->integer((int)(i << 12), seed);
+		bench_spread("integer keys, multiples of 4096", h, n);
+		free(h);
+	}
+
+	bench_threads(names, n);
+
+	free(symbols);
+	for (size_t i = 0; i < 2 * n; i++)
+		free(names[i]);
+	free(names);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000);
+		return EXIT_SUCCESS;
+	}
+
 	struct table *t = new_table();
 
 	table_add(t, STR("foo"),      STR("test"));